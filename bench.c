@@ -0,0 +1,82 @@
+/**
+ *  Allocation throughput with many threads. Every thread
+ *  keeps a window of live allocations of mixed sizes and
+ *  replaces one at random per step, the rate of all
+ *  threads together is printed for 1, 2, 4, ... threads
+ *  up to the number given.
+ *
+ *      $ make bench
+ *      $ ./bench-lockfree 16
+ */
+
+#include "buddy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+// live allocations per thread
+#define WINDOW 1024
+// replacements per thread
+#define STEPS 2000000
+
+// the sizes allocated, slab objects, cached and
+// uncached blocks, and over-aligned objects when 0
+static const size_t sizes[] = { 16, 48, 128, 256, 600, 1000, 4000, 0 };
+
+static void *run(void *arg)
+{
+	unsigned seed = (unsigned) (uintptr_t) arg;
+	void **window = bcalloc(WINDOW, sizeof(*window));
+	size_t size;
+	int i;
+
+	for (int step = 0; step < STEPS; step++) {
+		i = rand_r(&seed) % WINDOW;
+		bfree(window[i]);
+		size = sizes[rand_r(&seed) % (sizeof(sizes) / sizeof(*sizes))];
+		window[i] = size == 0 ? baligned_alloc(64, 64) : balloc(size);
+		if (window[i] == BNULL) {
+			abort();
+		}
+		// touch the memory like a real user would
+		*(char *) window[i] = (char) step;
+	}
+	for (i = 0; i < WINDOW; i++) {
+		bfree(window[i]);
+	}
+	bfree(window);
+	return NULL;
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int max = argc > 1 ? atoi(argv[1]) : 8;
+	pthread_t *threads = balloc(max * sizeof(*threads));
+	double start, elapsed;
+
+	for (int count = 1; count <= max; count *= 2) {
+		start = seconds();
+		for (int t = 0; t < count; t++) {
+			pthread_create(&threads[t], NULL, run,
+				       (void *) (uintptr_t) (t + 1));
+		}
+		for (int t = 0; t < count; t++) {
+			pthread_join(threads[t], NULL);
+		}
+		elapsed = seconds() - start;
+		printf("%3d threads: %7.2f Mops/s\n", count,
+		       (double) count * STEPS / elapsed / 1e6);
+	}
+	bfree(threads);
+	return 0;
+}
@@ -1,2 +1,5 @@
+// mremap is a GNU extension, buddy.h copies huge
+// allocations instead when it is missing
+#define _GNU_SOURCE
 #define BUDDY_IMPLEMENTATION
 #include "buddy.h"
@@ -0,0 +1,147 @@
+// C++ replacements of the global operator new and delete,
+// built into libbuddy.so next to buddy.c
+#include <new>
+#include "buddy.h"
+
+// allocate like the standard operator new, calling the
+// new handler until the allocation succeeds, `align` is 0
+// for the default alignment
+static void *allocate(std::size_t size, std::size_t align)
+{
+	void *ptr;
+
+	// new returns a distinct pointer for 0 bytes
+	if (size == 0) {
+		size = 1;
+	}
+	for (;;) {
+		ptr = align > 0 ? baligned_alloc(align, size) : balloc(size);
+		if (ptr != BNULL) {
+			return ptr;
+		}
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+static void *allocate_nothrow(std::size_t size, std::size_t align) noexcept
+{
+	try {
+		return allocate(size, align);
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+void *operator new(std::size_t size)
+{
+	return allocate(size, 0);
+}
+
+void *operator new[](std::size_t size)
+{
+	return allocate(size, 0);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+	return allocate_nothrow(size, 0);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+	return allocate_nothrow(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t align)
+{
+	return allocate(size, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t size, std::align_val_t align)
+{
+	return allocate(size, static_cast<std::size_t>(align));
+}
+
+void *operator new(std::size_t size, std::align_val_t align,
+		   const std::nothrow_t &) noexcept
+{
+	return allocate_nothrow(size, static_cast<std::size_t>(align));
+}
+
+void *operator new[](std::size_t size, std::align_val_t align,
+		     const std::nothrow_t &) noexcept
+{
+	return allocate_nothrow(size, static_cast<std::size_t>(align));
+}
+
+void operator delete(void *ptr) noexcept
+{
+	bfree(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	bfree(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+	bfree(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+	bfree(ptr);
+}
+
+// sized delete knows the size the memory was allocated
+// with, so bfree doesn't have to look up its block
+void operator delete(void *ptr, std::size_t size) noexcept
+{
+	bfree_sized(ptr, size);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept
+{
+	bfree_sized(ptr, size);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+	bfree(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+	bfree(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+		     const std::nothrow_t &) noexcept
+{
+	bfree(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+		       const std::nothrow_t &) noexcept
+{
+	bfree(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size,
+		     std::align_val_t align) noexcept
+{
+	bfree_aligned_sized(ptr, static_cast<std::size_t>(align),
+			    size == 0 ? 1 : size);
+}
+
+void operator delete[](void *ptr, std::size_t size,
+		       std::align_val_t align) noexcept
+{
+	bfree_aligned_sized(ptr, static_cast<std::size_t>(align),
+			    size == 0 ? 1 : size);
+}
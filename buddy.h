@@ -1,6 +1,7 @@
 /**
- *  Buddy allocator. Do not use in conjunction with
- *  malloc / free.
+ *  Buddy allocator. Memory is mapped with mmap, so it
+ *  can be used next to malloc / free, but memory from
+ *  one must not be freed with the other.
  *
  *  Usage:
  *
@@ -16,6 +17,12 @@
  *  buddy.h can also replace the default malloc implementation:
  *      $ make
  *      $ LD_PRELOAD=./libbuddy.so vim
+ *  Huge allocations are resized with mremap when the
+ *  implementation is compiled with _GNU_SOURCE, as
+ *  buddy.c is, and copied otherwise.
+ *  libbuddy-ticket.so, libbuddy-futex.so and libbuddy-nolock.so
+ *  are built with the other BUDDY_LOCK strategies, and
+ *  libbuddy-lockfree.so with BUDDY_LOCKFREE.
  */
 
 #ifndef BUDDY_H
@@ -28,23 +35,68 @@
 #define bfree    free
 #define brealloc realloc
 #define bcalloc  calloc
+#define btrim    malloc_trim
+#define baligned_alloc aligned_alloc
+#define busable_size   malloc_usable_size
+#define bfree_sized    free_sized
+#define bfree_aligned_sized free_aligned_sized
 #else
 #define BNULL ((void *) 0)
 #endif
 
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  *  Allocate `size` bytes of memory.
  *  Returns BNULL on failure.
  */
 void *balloc(size_t size);
 
+/**
+ *  Allocate at least `size` bytes of memory and store
+ *  in `usable` how many bytes the caller may use, which
+ *  is the whole block the request was rounded up to.
+ *  Returns BNULL on failure.
+ */
+void *balloc_sized(size_t size, size_t *usable);
+
+/**
+ *  Allocate `n` blocks of `size` bytes each into `ptrs`,
+ *  locking the heap once for all of them. Returns how
+ *  many were allocated, fewer than `n` on failure.
+ */
+size_t balloc_batch(size_t size, size_t n, void **ptrs);
+
 /**
  *  Free previously allocated memory.
  */
 void bfree(void *ptr);
 
+/**
+ *  Free memory from balloc, bcalloc or brealloc given
+ *  any `size` from the one it was last allocated or
+ *  resized to up to busable_size(ptr), without looking
+ *  up its block. A smaller size corrupts the heap.
+ */
+void bfree_sized(void *ptr, size_t size);
+
+/**
+ *  Free memory from baligned_alloc given the `alignment`
+ *  and `size` it was allocated with.
+ */
+void bfree_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+/**
+ *  Free the `n` allocations in `ptrs`, which may hold
+ *  BNULL, locking the heap once for neighbouring ones.
+ *  `ptrs` is sorted by address as a side effect.
+ */
+void bfree_batch(void **ptrs, size_t n);
+
 /**
  *  Attempt to reallocate memory to fit new size.
  *  Returns BNULL on failure.
@@ -57,6 +109,34 @@ void *brealloc(void *ptr, size_t size);
  */
 void *bcalloc(size_t nitems, size_t size);
 
+/**
+ *  Allocate `size` bytes of memory aligned to `alignment`,
+ *  which must be a power of two. Returns BNULL on failure.
+ */
+void *baligned_alloc(size_t alignment, size_t size);
+
+/**
+ *  Give free memory back to the kernel right away. Free
+ *  pages are released until at most `pad` bytes of them
+ *  are left resident in each arena. The first page of
+ *  each free block, free blocks of a page or less and
+ *  blocks kept in thread caches stay resident, and the
+ *  BUDDY_LOCKFREE build releases nothing.
+ *  Returns 1 if any memory was released, 0 otherwise.
+ */
+int btrim(size_t pad);
+
+/**
+ *  Returns how many bytes of the allocation at `ptr`
+ *  may be used, at least the size it was requested
+ *  with. Returns 0 for BNULL.
+ */
+size_t busable_size(void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 #ifdef BUDDY_IMPLEMENTATION
@@ -64,50 +144,400 @@ void *bcalloc(size_t nitems, size_t size);
 
 #include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// how long a free block of more than a page stays
+// resident before its pages are given back to the
+// kernel, in milliseconds
+#ifndef BUDDY_DECAY_MS
+#define BUDDY_DECAY_MS 10000
+#endif
+// the most free memory an arena keeps resident,
+// past this it is purged without waiting for
+// the decay time, in bytes
+#ifndef BUDDY_TRIM_THRESHOLD
+#define BUDDY_TRIM_THRESHOLD ((size_t) 64 << 20)
+#endif
+// requests of at least this many bytes get a mapping
+// of their own, rounded up to whole pages only
+#ifndef BUDDY_MMAP_THRESHOLD
+#define BUDDY_MMAP_THRESHOLD ((size_t) 1 << 20)
+#endif
+
+// the lock strategies BUDDY_LOCK selects from
+#define BUDDY_LOCK_PTHREAD 0	// pthread mutex
+#define BUDDY_LOCK_TICKET  1	// ticket spinlock
+#define BUDDY_LOCK_FUTEX   2	// spin, then sleep on a futex
+#define BUDDY_LOCK_NONE    3	// no locking, single-threaded only
+// how the arenas and the superblock table are locked
+#ifndef BUDDY_LOCK
+#define BUDDY_LOCK BUDDY_LOCK_PTHREAD
+#endif
+// defining BUDDY_LOCKFREE builds a heap whose blocks are
+// allocated and freed with atomic operations on the
+// superblock trees instead of under the arena locks, after
+// the non-blocking buddy system of Marotta et al., its free
+// memory is never purged or unmapped
+
+#if BUDDY_LOCK == BUDDY_LOCK_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+// glibc clears __libc_single_threaded when the process
+// creates its first thread, locks are skipped until then
+#if defined(__has_include)
+#if __has_include(<sys/single_threaded.h>)
+#include <sys/single_threaded.h>
+#define SINGLE_THREADED
+#endif
+#endif
+// glibc registers a restartable sequence for every thread,
+// on x86-64 small objects are then cached per CPU rather
+// than per thread, thread sanitizer can't follow them
+#if defined(__x86_64__) && defined(__has_include) &&\
+    !defined(__SANITIZE_THREAD__)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PERCPU
+#endif
+#endif
 
 typedef uint8_t byte_t;
 
+#if BUDDY_LOCK == BUDDY_LOCK_PTHREAD
+typedef pthread_mutex_t lock_t;
+#define LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#elif BUDDY_LOCK == BUDDY_LOCK_TICKET
+// a thread takes the next ticket and waits until
+// it is the one being served
+typedef struct {
+	uint32_t next;
+	uint32_t owner;
+} lock_t;
+#define LOCK_INITIALIZER { 0, 0 }
+#elif BUDDY_LOCK == BUDDY_LOCK_FUTEX
+// 0 when unlocked, 1 when locked, 2 when locked
+// and threads may sleep on it
+typedef uint32_t lock_t;
+#define LOCK_INITIALIZER 0
+#elif BUDDY_LOCK == BUDDY_LOCK_NONE
+typedef int lock_t;
+#define LOCK_INITIALIZER 0
+#else
+#error "BUDDY_LOCK is not one of the BUDDY_LOCK_* strategies"
+#endif
+
+// a free block, the free list links are kept in its memory,
+// allocated blocks have no header at all
 struct block {
-	size_t size;
-	int used;
-	 _Alignas(max_align_t) byte_t mem[];
+	struct block *next;
+	struct block *prev;
+};
+
+// a block freed by a thread of another arena, waiting
+// in the remote queue of its arena
+struct remote_block {
+	struct remote_block *next;
+	size_t order;
 };
 
-// find next block
-#define NEXT(block_ptr)\
-    (struct block *)((byte_t*)(block_ptr) + (block_ptr)->size)
-// the offset of the usable memory region in a block
-#define MEMOFFSET (offsetof(struct block, mem))
-// the size of usable memory `block_ptr` can hold
-#define MEMSIZE(block_ptr) (size_t)((block_ptr)->size - MEMOFFSET)
-// get pointer to block containing `mem`
-#define BLOCK(mem) (struct block *)((byte_t *)mem - MEMOFFSET)
-// the size of usable memory if we would split `block_ptr`
-#define HALFMEMSIZE(block_ptr)\
-    (size_t)((block_ptr)->size / 2 - MEMOFFSET)
-// the smallest size a block can be
-#define MINBLOCKSIZE 16
-// the size of a block that can hold `memsize` bytes
-// of usable memory
-#define BLOCKSIZE(memsize) (memsize + MEMOFFSET)
+// a free block of more than a page, its first page
+// holds its state and the rest can be purged
+struct large_block {
+	struct block block;
+	// links of the dirty list of the arena, oldest first
+	struct large_block *next_dirty;
+	struct large_block *prev_dirty;
+	// when the block was freed, in milliseconds
+	uint64_t freed_at;
+	size_t order;
+	// how many bytes past the first page may be resident,
+	// 0 when they have all been purged or never touched
+	size_t resident;
+};
+
+// the number of block orders, one per bit of size_t
+#define NORDERS (sizeof(size_t) * 8)
+
+/**
+ *  The heap is made of superblocks, each one buddy heap of
+ *  1 << order bytes with an implicit binary tree over its
+ *  blocks. The root is node 1 and the children of node i
+ *  are 2i and 2i + 1. A node stores how many orders below
+ *  its own order the largest free block under it is, so a
+ *  zero node is a free block and fresh zeroed metadata is
+ *  an empty superblock. An allocated block is a used node
+ *  with only zero nodes below it, which is how its order
+ *  is found again when it is freed. Every superblock
+ *  belongs to one arena.
+ *
+ *  A huge allocation above BUDDY_MMAP_THRESHOLD is
+ *  described by a superblock without arena or tree, so
+ *  it is found the same way.
+ */
+struct superblock {
+	struct arena *arena;
+	byte_t *base;
+	size_t order;
+	// the size of a huge allocation, 0 for a buddy heap
+	size_t huge;
+#ifdef BUDDY_LOCKFREE
+	// the next older superblock of the heap
+	struct superblock *next;
+	// per order, a HINT of the first node of its level
+	// that may be a free block
+	uint64_t hints[NORDERS];
+#endif
+	byte_t tree[];
+};
+
+// the block `offset` bytes past `block_ptr`
+#define OFFSET(block_ptr, offset)\
+    (struct block *)((byte_t *)(block_ptr) + (offset))
+// the size of a block of `order`
+#define SIZE(order) ((size_t) 1 << (order))
+// log2 of the smallest size a block can be
+#define MINORDER 4
+// the smallest size a block can be, must hold
+// free list links
+#define MINBLOCKSIZE SIZE(MINORDER)
 // the byte offset between two pointers
 #define BYTEDIFF(ptr1, ptr2)\
     (size_t) ((byte_t *) ptr2 - (byte_t *) ptr1)
+// log2 of the size of a superblock, larger requests
+// get a superblock of their own
+#define SUPERBLOCKORDER 22
+// the size of the metadata of a superblock of `order`
+#define METASIZE(order)\
+    (sizeof(struct superblock) + SIZE((order) - MINORDER + 1))
+// tree node value of a node with no free block under it
+#define TREE_USED 0xff
+// tree node value of an allocated block that is a slab,
+// counts as used for its parents
+#define TREE_SLAB 0xfe
+#ifdef BUDDY_LOCKFREE
+// tree node bits of the lock-free heap, where a node that
+// is 0 is a free block, a left child has an even index
+#define NODE_OCC_RIGHT  0x01	// a block is used under the right child
+#define NODE_OCC_LEFT   0x02	// a block is used under the left child
+#define NODE_COAL_RIGHT 0x04	// the right child is being freed
+#define NODE_COAL_LEFT  0x08	// the left child is being freed
+#define NODE_OCC        0x10	// the node is a used block
+#define NODE_SLAB       0x20	// the used block is a slab
+#define NODE_BUSY (NODE_OCC | NODE_OCC_LEFT | NODE_OCC_RIGHT)
+// the bit of `left_bit` for the side of `node` in its parent
+#define SIDE(node, left_bit) ((node) & 1 ? (left_bit) >> 1 : (left_bit))
+// a search hint, the `index` of a node within its level,
+// whose `version` counts the frees that may have lowered it
+#define HINT(index, version) (((uint64_t) (version) << 32) | (index))
+// the depth of tree node `node`, the root is at depth 0
+#define DEPTH(node) (NORDERS - 1 - __builtin_clzl(node))
+#endif
+// the tree node of the block of `block_order` at `block_ptr`
+#define NODE(sb, block_ptr, block_order)\
+    (((size_t) 1 << ((sb)->order - (block_order))) +\
+     (BYTEDIFF((sb)->base, block_ptr) >> (block_order)))
+// log2 of the size of a slab
+#define SLABORDER 12
+// the largest request served from slabs
+#define SLABMAX 256
+// the number of slab size classes
+#define NCLASSES (sizeof(class_sizes) / sizeof(class_sizes[0]))
+// the slab holding the object at `ptr`
+#define SLAB(ptr)\
+    ((struct slab *)((uintptr_t) (ptr) & ~(SIZE(SLABORDER) - 1)))
+// log2 of the smallest block handed out for requests
+// above SLABMAX
+#define CACHEMINORDER 9
+// log2 of the largest block kept in thread caches
+#define CACHEMAXORDER 10
+// the number of kinds of objects thread caches keep,
+// one per slab class and one per cached block order
+#define NBINS (NCLASSES + CACHEMAXORDER - CACHEMINORDER + 1)
+// the number of blocks moved between a thread cache
+// and the heap at once
+#define CACHEBATCH 32
+// the most objects of one bin a CPU cache keeps
+#define CPUSLOTS (2 * CACHEBATCH)
+// CPUs with a number from this on have no CPU cache
+#define NCPUS 1024
+// the number of locked operations on an arena between
+// looking for blocks to purge
+#define PURGETICKS 64
+// the most blocks purged at once
+#define PURGEBATCH 8
+// how often the spinning locks poll before they
+// give up the processor
+#define SPINCOUNT 100
+// copies of at least this many bytes bypass the cache,
+// they would only evict the working set
+#define STREAMSIZE ((size_t) 256 << 10)
+// the number of independent heaps threads are spread over
+#define NARENAS 8
+// the size of a cache line, locks are kept on lines
+// of their own
+#define CACHELINE 64
+// the number of address bits that may be set in a pointer
+#define ADDRBITS 48
+// the superblock table is indexed by the address bits
+// above SUPERBLOCKORDER, split over two levels
+#define SLOTBITS (ADDRBITS - SUPERBLOCKORDER)
+#define LEAFBITS (SLOTBITS / 2)
+#define LEAFSIZE ((size_t) 1 << LEAFBITS)
+
+_Static_assert(MINBLOCKSIZE >= sizeof(struct block),
+	       "MINBLOCKSIZE can't hold free list links");
+_Static_assert(MINBLOCKSIZE >= sizeof(struct remote_block),
+	       "MINBLOCKSIZE can't hold remote queue links");
+_Static_assert(MINBLOCKSIZE % _Alignof(max_align_t) == 0,
+	       "MINBLOCKSIZE breaks alignment of allocations");
+
+// the object sizes of the slab classes, those of 16 bytes
+// and more are multiples of 16 so their objects are aligned
+// like any other allocation
+static const uint16_t class_sizes[] = {
+	8, 16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+};
+
+/**
+ *  A block of SLABORDER carved into objects of one size
+ *  class. Objects have no header, a bitmap tracks which
+ *  ones are in use and the tree marks the block as a slab
+ *  so bfree can tell slab objects from blocks.
+ */
+struct slab {
+	// links of the list of slabs of the class
+	// that have free objects
+	struct slab *next;
+	struct slab *prev;
+	// the arena whose class lists the slab is on
+	struct arena *arena;
+	uint32_t size_class;
+	// the number of objects in use
+	uint32_t used;
+	// bit i is set when object i is in use,
+	// or when there is no object i
+	uint64_t bitmap[SIZE(SLABORDER) / 8 / 64];
+	// the objects start here, or at the next
+	// multiple of their alignment, see slab_start
+	_Alignas(max_align_t) byte_t objects[];
+};
+
+// the slabs of one class of an arena, objects of different
+// classes are handed out in parallel
+struct slab_class {
+	// guards the slabs of the class, the arena lock is
+	// taken inside it to get or give back a slab
+	_Alignas(CACHELINE) lock_t lock;
+	// slabs of the class with free objects
+	struct slab *slabs;
+};
+
+// an independent buddy heap with its own lock
+struct arena {
+	// guards the blocks of the arena, slab objects are
+	// guarded by the locks of their classes
+	lock_t lock;
+	// free blocks of size 1 << order, linked through
+	// their memory
+	struct block *free_lists[NORDERS];
+	// bit `order` is set when free_lists[order] is
+	// non-empty
+	size_t free_mask;
+	// the number of superblocks mapped for the arena
+	size_t superblocks;
+	// large free blocks that are not purged yet,
+	// in the order they were freed
+	struct large_block *dirty_head;
+	struct large_block *dirty_tail;
+	// the number of bytes the dirty list could purge
+	size_t dirty_size;
+	// locked operations since the last purge
+	size_t ticks;
+	struct slab_class classes[NCLASSES];
+	// blocks threads of other arenas freed, pushed
+	// without the lock
+	_Alignas(CACHELINE) struct remote_block *remote;
+};
+
+// small free objects and blocks a thread keeps to itself,
+// they stay used in their slab or the tree and are linked
+// through `next`, bins are slab classes and then block
+// orders from CACHEMINORDER
+struct cache {
+	struct block *lists[NBINS];
+	size_t counts[NBINS];
+	enum {
+		CACHE_NEW,	// not registered for flushing yet
+		CACHE_ACTIVE,
+		CACHE_DEAD,	// flushed on thread exit
+	} state;
+};
+
+#ifdef PERCPU
+// free objects of one bin a CPU keeps, the first
+// `count` slots hold them
+struct cpu_bin {
+	size_t count;
+	void *slots[CPUSLOTS];
+};
+
+// small free objects of the threads running on a CPU,
+// only changed in restartable sequences on that CPU so
+// it takes neither locks nor atomic operations
+struct cpu_cache {
+	struct cpu_bin bins[NBINS];
+};
+#endif
 
-// points to the first block in memory
-static struct block *start;
-// points to the end of last block in memory
-static struct block *end;
-// points to the next block to consider for allocation
-static struct block *next;
-// lock for the whole allocator
-static pthread_mutex_t lock;
+static struct arena arenas[NARENAS];
+// the arena handed to the next thread
+static size_t next_arena;
+// superblock of every SUPERBLOCKORDER aligned slot in use
+static struct superblock **registry[(size_t) 1 << (SLOTBITS - LEAFBITS)];
+#ifdef BUDDY_LOCKFREE
+// the superblocks of the lock-free heap, newest first,
+// it only ever grows at the head
+static struct superblock *heap;
+// the superblock the calling thread last allocated from
+static __thread struct superblock *thread_superblock
+    __attribute__((tls_model("initial-exec")));
+#endif
+// lock for growing the heap and the superblock table,
+// nothing is done while holding it that takes it again
+static lock_t lock = LOCK_INITIALIZER;
+// the cache of the calling thread, initial-exec keeps
+// TLS access from allocating when preloaded
+static __thread struct cache cache
+    __attribute__((tls_model("initial-exec")));
+#ifdef PERCPU
+// the cache of every CPU a thread has run on
+static struct cpu_cache *cpu_caches[NCPUS];
+#endif
+// the arena of the calling thread
+static __thread struct arena *thread_arena
+    __attribute__((tls_model("initial-exec")));
+// flushes a thread's cache when it exits
+static pthread_key_t cache_key;
+// log2 of the page size
+static size_t page_order;
 // library initialization flag
 static int Buddy_Is_Init = 0;
 
+static void cache_destroy(void *arg);
+#ifndef BUDDY_LOCKFREE
+static void remote_drain(struct arena *arena);
+#endif
+
 #ifdef BUDDY_STDLIB_OVERRIDE
 // we call bfree (=free when this ^^^ is defined)
 // and then use the pointer in some functions
@@ -115,274 +545,2460 @@ static int Buddy_Is_Init = 0;
 #pragma GCC diagnostic ignored "-Wuse-after-free"
 #endif
 
-//__attribute__((constructor(101)))
-static void init(void)
+#if BUDDY_LOCK == BUDDY_LOCK_TICKET || BUDDY_LOCK == BUDDY_LOCK_FUTEX
+// tell the processor this is a spin loop
+static void cpu_relax(void)
 {
-	pthread_mutexattr_t lock_attr;
-	// lock may be aquired multiple times,
-	// for example when brealloc calls balloc
-	pthread_mutexattr_settype(&lock_attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&lock, &lock_attr);
-	pthread_mutex_lock(&lock);
-
-	if (Buddy_Is_Init) {
-		return;
-	}
-	// setup an inital block of size BUDDY_BLOCK_INIT_SIZE
-	start = sbrk(0);
-
-	size_t pagesize = sysconf(_SC_PAGESIZE);
+#ifdef __SSE2__
+	_mm_pause();
+#endif
+}
+#endif
 
-	// adjust alignment if necessary
-	if ((size_t)start % pagesize > 0) {
-		(void)sbrk(pagesize - (size_t)start % pagesize);
-		start = sbrk(0);
-	}
+#if BUDDY_LOCK == BUDDY_LOCK_PTHREAD
 
-	if (sbrk(pagesize) == (void *)-1) {
-		assert(0 && "failed to initialize buddy.h");
-	}
-	end = (struct block *)
-	    ((byte_t *) start + pagesize);
+static void lock_init(lock_t *l)
+{
+	pthread_mutex_init(l, BNULL);
+}
 
-	next = start;
-	next->size = pagesize;
-	next->used = 0;
-	Buddy_Is_Init = 1;
-	pthread_mutex_unlock(&lock);
+static void raw_acquire(lock_t *l)
+{
+	pthread_mutex_lock(l);
 }
 
-static struct block *grow(size_t required)
+static int raw_try(lock_t *l)
 {
-	required = BLOCKSIZE(required);
-	size_t current_size;
-	struct block *block;
+	return pthread_mutex_trylock(l) == 0;
+}
 
-	// if there is just one free block,
-	// just grow that
-	if (NEXT(start) == end && !start->used) {
-		size_t size = start->size;
-		while (size < required) {
-			size *= 2;
-		}
+static void raw_release(lock_t *l)
+{
+	pthread_mutex_unlock(l);
+}
 
-		if (sbrk(size - start->size) == (void *)-1) {
-			return BNULL;
-		}
+#elif BUDDY_LOCK == BUDDY_LOCK_TICKET
 
-		start->size = size;
-		end = NEXT(start);
+static void lock_init(lock_t *l)
+{
+	l->next = 0;
+	l->owner = 0;
+}
 
-		return start;
+static void raw_acquire(lock_t *l)
+{
+	uint32_t ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+
+	for (size_t spins = 0;
+	     __atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != ticket; spins++) {
+		// let a preempted holder run
+		if (spins >= SPINCOUNT) {
+			sched_yield();
+			spins = 0;
+		}
+		cpu_relax();
 	}
-	// keep growing until last block is big enough
-	do {
-		current_size = BYTEDIFF(start, end);
+}
 
-		if (sbrk(current_size) == (void *)-1) {
-			return BNULL;
-		}
+static int raw_try(lock_t *l)
+{
+	uint32_t owner = __atomic_load_n(&l->owner, __ATOMIC_RELAXED);
+	uint32_t next = owner;
 
-		block = end;
-		block->size = current_size;
-		block->used = 0;
+	// free when no ticket past the owner is out
+	return __atomic_compare_exchange_n(&l->next, &next, owner + 1, 0,
+					   __ATOMIC_ACQUIRE,
+					   __ATOMIC_RELAXED);
+}
 
-		end = NEXT(block);
+static void raw_release(lock_t *l)
+{
+	__atomic_store_n(&l->owner, l->owner + 1, __ATOMIC_RELEASE);
+}
 
-	} while (current_size < required);
+#elif BUDDY_LOCK == BUDDY_LOCK_FUTEX
 
-	return block;
+static void futex(lock_t *l, int op, uint32_t val)
+{
+	syscall(SYS_futex, l, op, val, BNULL, BNULL, 0);
 }
 
-static void split(struct block *block)
+static void lock_init(lock_t *l)
 {
-	block->size /= 2;
-	struct block *next = NEXT(block);
-	next->size = block->size;
-	next->used = 0;
+	*l = 0;
 }
 
-static struct block *join(struct block *block)
+static int raw_try(lock_t *l)
 {
-	struct block *buddy, *joined;
-	size_t size = block->size;
+	uint32_t unlocked = 0;
 
-	for (;;) {
-		if (BYTEDIFF(start, block) % (size * 2) == 0) {
-			buddy = (struct block *)((byte_t *) block + size);
-			joined = block;
-		} else {
-			buddy = (struct block *)((byte_t *) block - size);
-			joined = buddy;
-		}
+	return __atomic_compare_exchange_n(l, &unlocked, 1, 0,
+					   __ATOMIC_ACQUIRE,
+					   __ATOMIC_RELAXED);
+}
 
-		if (buddy == end || buddy->size != size || buddy->used) {
-			break;
-		} else {
-			block = joined;
-			size *= 2;
+static void raw_acquire(lock_t *l)
+{
+	// critical sections are short, the holder is
+	// likely done before it is worth sleeping
+	for (size_t spins = 0; spins < SPINCOUNT; spins++) {
+		if (__atomic_load_n(l, __ATOMIC_RELAXED) == 0 && raw_try(l)) {
+			return;
 		}
+		cpu_relax();
+	}
+	// mark the lock as having sleepers, whoever
+	// releases it wakes one
+	while (__atomic_exchange_n(l, 2, __ATOMIC_ACQUIRE) != 0) {
+		futex(l, FUTEX_WAIT_PRIVATE, 2);
 	}
-
-	block->size = size;
-	block->used = 0;
-	return block;
 }
 
-void *balloc(size_t size)
+static void raw_release(lock_t *l)
 {
-	if (!Buddy_Is_Init) {
-		init();
+	if (__atomic_exchange_n(l, 0, __ATOMIC_RELEASE) == 2) {
+		futex(l, FUTEX_WAKE_PRIVATE, 1);
 	}
+}
 
-	if (size == 0) {
-		return BNULL;
-	}
+#elif BUDDY_LOCK == BUDDY_LOCK_NONE
 
-	pthread_mutex_lock(&lock);
+static void lock_init(lock_t *l)
+{
+	(void) l;
+}
 
-	struct block *block = next;
+static void raw_acquire(lock_t *l)
+{
+	(void) l;
+}
 
-	// search for unused block that fits allocation
-	while (MEMSIZE(block) < size || block->used) {
+static int raw_try(lock_t *l)
+{
+	(void) l;
+	return 1;
+}
 
-		block = NEXT(block);
+static void raw_release(lock_t *l)
+{
+	(void) l;
+}
 
-		// wrap around
-		if (block == end) {
-			block = start;
-		}
-		// went through all available blocks
-		// try to grow
-		if (block == next) {
-			block = grow(size);
-			if (block == BNULL) {
-				// can't grow
-				pthread_mutex_unlock(&lock);
-				return BNULL;
-			}
-			break;
-		}
-	}
+#endif
+
+// a process with one thread can't contend, and no lock
+// is held across the pthread_create that ends it
+static int single_threaded(void)
+{
+#ifdef SINGLE_THREADED
+	return __libc_single_threaded;
+#else
+	return 0;
+#endif
+}
 
-	// split until we have best fit
-	while (HALFMEMSIZE(block) >= size && block->size > MINBLOCKSIZE) {
-		split(block);
+// returns whether `l` itself was taken, which must be
+// passed to lock_release, so both follow one decision
+// even if the process stops being single-threaded
+static int lock_acquire(lock_t *l)
+{
+	if (single_threaded()) {
+		return 0;
 	}
+	raw_acquire(l);
+	return 1;
+}
 
-	// record where we should start searching next
-	next = NEXT(block);
-	if (next == end) {
-		next = start;
+// returns 1 if `l` was taken, `*held` is set to what
+// lock_acquire would have returned
+static int lock_try(lock_t *l, int *held)
+{
+	*held = !single_threaded();
+	return !*held || raw_try(l);
+}
+
+static void lock_release(lock_t *l, int held)
+{
+	if (held) {
+		raw_release(l);
 	}
+}
+
+// lock the blocks of `arena`, the lock-free heap has
+// no lock for them, returns what heap_release takes,
+// blocks other threads queued for the arena are freed
+// first, so they don't stay used while it is idle
+static int heap_acquire(struct arena *arena)
+{
+#ifdef BUDDY_LOCKFREE
+	(void) arena;
+	return 0;
+#else
+	int held = lock_acquire(&arena->lock);
 
-	block->used = 1;
-	pthread_mutex_unlock(&lock);
-	return block->mem;
+	remote_drain(arena);
+	return held;
+#endif
 }
 
-void bfree(void *ptr)
+static int heap_try(struct arena *arena, int *held)
 {
-	if (ptr == BNULL) {
-		return;
+#ifdef BUDDY_LOCKFREE
+	(void) arena;
+	*held = 0;
+	return 1;
+#else
+	if (!lock_try(&arena->lock, held)) {
+		return 0;
 	}
+	remote_drain(arena);
+	return 1;
+#endif
+}
 
-	pthread_mutex_lock(&lock);
-	struct block *block = BLOCK(ptr);
-	block = join(block);
-	next = block;
-	pthread_mutex_unlock(&lock);
+static void heap_release(struct arena *arena, int held)
+{
+#ifdef BUDDY_LOCKFREE
+	(void) arena;
+	(void) held;
+#else
+	lock_release(&arena->lock, held);
+#endif
 }
 
-void *brealloc(void *ptr, size_t size)
+#ifndef BUDDY_LOCKFREE
+
+static uint64_t now_ms(void)
 {
-	pthread_mutex_lock(&lock);
-	struct block *block, *buddy;
-	size_t block_size;
-	byte_t *new_ptr;
+	struct timespec ts;
 
-	if (ptr == BNULL) {
-		pthread_mutex_unlock(&lock);
-		return balloc(size);
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void dirty_push(struct arena *arena, struct large_block *block)
+{
+	arena->dirty_size += block->resident;
+	block->next_dirty = BNULL;
+	block->prev_dirty = arena->dirty_tail;
+	if (arena->dirty_tail != BNULL) {
+		arena->dirty_tail->next_dirty = block;
+	} else {
+		arena->dirty_head = block;
 	}
+	arena->dirty_tail = block;
+}
 
-	if (size == 0) {
-		bfree(ptr);
-		pthread_mutex_unlock(&lock);
-		return BNULL;
+static void dirty_remove(struct arena *arena, struct large_block *block)
+{
+	arena->dirty_size -= block->resident;
+	if (block->prev_dirty != BNULL) {
+		block->prev_dirty->next_dirty = block->next_dirty;
+	} else {
+		arena->dirty_head = block->next_dirty;
+	}
+	if (block->next_dirty != BNULL) {
+		block->next_dirty->prev_dirty = block->prev_dirty;
+	} else {
+		arena->dirty_tail = block->prev_dirty;
 	}
+}
 
-	block = BLOCK(ptr);
+// `resident` is how many bytes of `block` past its first
+// page may be resident, at most all of them, 0 when they
+// are known to be purged or fresh from the kernel,
+// `freed_at` is when it was freed, 0 for now
+static void push_free(struct arena *arena, struct block *block,
+		      size_t order, size_t resident, uint64_t freed_at)
+{
+	struct block *head = arena->free_lists[order];
 
-	if (MEMSIZE(block) >= size) {
-		while ((block->size / 2 - MEMOFFSET) >= size) {
-			split(block);
+	block->prev = BNULL;
+	block->next = head;
+	if (head != BNULL) {
+		head->prev = block;
+	}
+	arena->free_lists[order] = block;
+	arena->free_mask |= (size_t) 1 << order;
+
+	if (order > page_order) {
+		struct large_block *large = (struct large_block *) block;
+		large->order = order;
+		large->resident = resident < SIZE(order) - SIZE(page_order) ?
+		    resident : SIZE(order) - SIZE(page_order);
+		if (large->resident > 0) {
+			large->freed_at = freed_at != 0 ? freed_at : now_ms();
+			dirty_push(arena, large);
 		}
-		next = NEXT(block);
-		pthread_mutex_unlock(&lock);
-		return block->mem;
 	}
+}
 
-	block_size = block->size;
-
-	// try to grow current block by joining
-	// with only right buddies
-	for (;;) {
-		if (block_size >= BLOCKSIZE(size)) {
-			block->size = block_size;
-			next = NEXT(block);
-			pthread_mutex_unlock(&lock);
-			return block->mem;
-		}
+static void remove_free(struct arena *arena,
+			struct block *block, size_t order)
+{
+	if (block->prev != BNULL) {
+		block->prev->next = block->next;
+	} else {
+		arena->free_lists[order] = block->next;
+	}
+	if (block->next != BNULL) {
+		block->next->prev = block->prev;
+	}
+	if (arena->free_lists[order] == BNULL) {
+		arena->free_mask &= ~((size_t) 1 << order);
+	}
 
-		buddy = (struct block *)((byte_t *) block + block_size);
+	if (order > page_order &&
+	    ((struct large_block *) block)->resident > 0) {
+		dirty_remove(arena, (struct large_block *) block);
+	}
+}
 
-		if (BYTEDIFF(start, block) % (block_size * 2) > 0 ||
-		    buddy == end || buddy->size != block_size || buddy->used) {
+// give the pages of blocks that have been free for
+// `decay` milliseconds back to the kernel, oldest first,
+// until `keep` bytes are left or `limit` blocks are
+// purged, returns the number of blocks purged
+static size_t purge(struct arena *arena, uint64_t decay,
+		    size_t keep, size_t limit)
+{
+	uint64_t now = now_ms();
+	size_t page = SIZE(page_order);
+	struct large_block *block;
+	size_t i;
+
+	for (i = 0; i < limit && arena->dirty_size > keep; i++) {
+		block = arena->dirty_head;
+		if (now - block->freed_at < decay) {
 			break;
 		}
+		dirty_remove(arena, block);
+		madvise((byte_t *) block + page, SIZE(block->order) - page,
+			MADV_DONTNEED);
+		block->resident = 0;
+	}
+	return i;
+}
 
-		block_size *= 2;
+// count a locked operation on `arena`, freeing its
+// queued blocks and purging every PURGETICKS of them
+static void tick(struct arena *arena)
+{
+	if ((arena->dirty_head != BNULL ||
+	     __atomic_load_n(&arena->remote, __ATOMIC_RELAXED) != BNULL) &&
+	    ++arena->ticks >= PURGETICKS) {
+		arena->ticks = 0;
+		remote_drain(arena);
+		purge(arena, BUDDY_DECAY_MS, 0, PURGEBATCH);
 	}
+}
 
-	block_size = block->size;
-	bfree(ptr);
+#endif
 
-	new_ptr = balloc(size);
-	if (new_ptr == BNULL) {
-		// restore freed block
-		block->size = block_size;
-		block->used = 1;
-		pthread_mutex_unlock(&lock);
-		return BNULL;
+// the slab class of the smallest objects that can
+// hold `size` bytes, `size` is at most SLABMAX
+static size_t class_of(size_t size)
+{
+	if (size <= 16) {
+		return size <= 8 ? 0 : 1;
 	}
+	if (size <= 128) {
+		return 2 + (size - 17) / 16;
+	}
+	return 9 + (size - 129) / 32;
+}
 
-	if (new_ptr < (byte_t *) ptr) {
-		for (size_t i = 0; i < MEMSIZE(block); i++) {
-			new_ptr[i] = ((byte_t *) ptr)[i];
-		}
-	} else {
-		for (size_t i = MEMSIZE(block); i > 0; i--) {
-			new_ptr[i - 1] = ((byte_t *) ptr)[i - 1];
-		}
+// the order of the smallest block that can hold
+// `size` bytes of usable memory
+static size_t order_of(size_t size)
+{
+	if (size <= MINBLOCKSIZE) {
+		return MINORDER;
 	}
+	return NORDERS - __builtin_clzl(size - 1);
+}
 
-	pthread_mutex_unlock(&lock);
-	return new_ptr;
+static void *map(size_t size)
+{
+	void *ptr = mmap(BNULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return ptr == MAP_FAILED ? BNULL : ptr;
 }
 
-void *bcalloc(size_t nitems, size_t size)
+// map `size` bytes aligned to `align`
+static void *map_aligned(size_t size, size_t align)
 {
-	size *= nitems;
-	char *ptr = balloc(size);
+	byte_t *ptr = map(size + align);
+	size_t pad;
+
 	if (ptr == BNULL) {
 		return BNULL;
 	}
-	memset(ptr, 0, size);
-	return ptr;
+	// trim the mapping down to the aligned part
+	pad = -(uintptr_t) ptr & (align - 1);
+	if (pad > 0) {
+		munmap(ptr, pad);
+	}
+	munmap(ptr + pad + size, align - pad);
+	return ptr + pad;
+}
+
+static struct superblock *superblock_of(void *ptr)
+{
+	size_t slot = (uintptr_t) ptr >> SUPERBLOCKORDER;
+	struct superblock **leaf = registry[slot >> LEAFBITS];
+
+	assert(leaf != BNULL && "pointer not allocated by buddy.h");
+	return leaf[slot & (LEAFSIZE - 1)];
+}
+
+// the number of superblock table slots `sb` covers
+static size_t slot_count(struct superblock *sb)
+{
+	if (sb->huge > 0) {
+		return (sb->huge + SIZE(SUPERBLOCKORDER) - 1) >>
+		    SUPERBLOCKORDER;
+	}
+	return SIZE(sb->order - SUPERBLOCKORDER);
+}
+
+// map the table leaves of `count` slots from `first`
+static int add_leaves(size_t first, size_t count)
+{
+	for (size_t slot = first; slot < first + count; slot++) {
+		struct superblock ***leaf = &registry[slot >> LEAFBITS];
+		if (*leaf == BNULL) {
+			*leaf = map(LEAFSIZE * sizeof(**leaf));
+			if (*leaf == BNULL) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+// point every slot `sb` covers at `sb`
+static int register_superblock(struct superblock *sb)
+{
+	size_t first = (uintptr_t) sb->base >> SUPERBLOCKORDER;
+	size_t count = slot_count(sb);
+
+	if (add_leaves(first, count) < 0) {
+		return -1;
+	}
+	for (size_t slot = first; slot < first + count; slot++) {
+		registry[slot >> LEAFBITS][slot & (LEAFSIZE - 1)] = sb;
+	}
+	return 0;
+}
+
+static void unregister_superblock(struct superblock *sb)
+{
+	size_t first = (uintptr_t) sb->base >> SUPERBLOCKORDER;
+	size_t count = slot_count(sb);
+
+	for (size_t slot = first; slot < first + count; slot++) {
+		struct superblock **leaf = registry[slot >> LEAFBITS];
+		// a failed register_superblock can leave
+		// slots without a leaf, and pages huge_realloc
+		// gave up may be mapped and registered again
+		// before their old slots are cleared
+		if (leaf != BNULL && leaf[slot & (LEAFSIZE - 1)] == sb) {
+			leaf[slot & (LEAFSIZE - 1)] = BNULL;
+		}
+	}
+}
+
+#ifndef BUDDY_LOCKFREE
+
+// recompute the ancestors of tree node `node`
+static void tree_update(byte_t *tree, size_t node)
+{
+	for (; node > 1; node /= 2) {
+		byte_t left = tree[node & ~(size_t) 1];
+		byte_t right = tree[node | 1];
+		byte_t value = left < right ? left : right;
+
+		value = value >= TREE_SLAB ? TREE_USED : value + 1;
+		if (tree[node / 2] == value) {
+			break;
+		}
+		tree[node / 2] = value;
+	}
+}
+
+// give the block of order `to` holding `block` tree
+// value `value`, the nodes on the way up from `block`
+// at order `from` become part of it
+static void tree_set(struct superblock *sb, struct block *block,
+		     size_t from, size_t to, byte_t value)
+{
+	for (; from < to; from++) {
+		sb->tree[NODE(sb, block, from)] = 0;
+	}
+	sb->tree[NODE(sb, block, to)] = value;
+	tree_update(sb->tree, NODE(sb, block, to));
+}
+
+// the order of the allocated block at `ptr`, the
+// first used node on the way up from the smallest
+// block at `ptr`
+static size_t order_at(struct superblock *sb, void *ptr)
+{
+	size_t node = NODE(sb, ptr, MINORDER);
+	size_t order = MINORDER;
+
+	for (; sb->tree[node] == 0; node /= 2) {
+		order++;
+	}
+	return order;
+}
+
+// whether the allocated block of `order` at `ptr` is a slab
+static int is_slab(struct superblock *sb, void *ptr, size_t order)
+{
+	return sb->tree[NODE(sb, ptr, order)] == TREE_SLAB;
+}
+
+// mark the allocated block of SLABORDER at `slab` as a
+// slab, the arena lock must be held
+static void mark_slab(struct superblock *sb, struct slab *slab)
+{
+	tree_set(sb, (struct block *) slab, SLABORDER, SLABORDER, TREE_SLAB);
+}
+
+#else
+
+// the order of the allocated block at `ptr`, the highest
+// used block on the way up from the smallest block at
+// `ptr`, used blocks below it are allocations that are
+// being rolled back
+static size_t order_at(struct superblock *sb, void *ptr)
+{
+	size_t node = NODE(sb, ptr, MINORDER);
+	size_t order = MINORDER, found = MINORDER;
+
+	for (; node >= 1; node /= 2, order++) {
+		if (__atomic_load_n(&sb->tree[node], __ATOMIC_RELAXED) &
+		    NODE_OCC) {
+			found = order;
+		}
+	}
+	return found;
+}
+
+static int is_slab(struct superblock *sb, void *ptr, size_t order)
+{
+	return __atomic_load_n(&sb->tree[NODE(sb, ptr, order)],
+			       __ATOMIC_RELAXED) & NODE_SLAB;
+}
+
+static void mark_slab(struct superblock *sb, struct slab *slab)
+{
+	__atomic_fetch_or(&sb->tree[NODE(sb, slab, SLABORDER)], NODE_SLAB,
+			  __ATOMIC_RELAXED);
+}
+
+#endif
+
+//__attribute__((constructor(101)))
+static void init(void)
+{
+	int held;
+
+	// threads racing to the first allocation
+	// initialize once
+	held = lock_acquire(&lock);
+	if (Buddy_Is_Init) {
+		lock_release(&lock, held);
+		return;
+	}
+	for (size_t c = 0; c < NCLASSES; c++) {
+		assert((class_sizes[c] < _Alignof(max_align_t) ||
+			class_sizes[c] % _Alignof(max_align_t) == 0) &&
+		       "slab class breaks alignment of allocations");
+	}
+	for (size_t i = 0; i < NARENAS; i++) {
+		lock_init(&arenas[i].lock);
+		for (size_t c = 0; c < NCLASSES; c++) {
+			lock_init(&arenas[i].classes[c].lock);
+		}
+	}
+	page_order = __builtin_ctzl(sysconf(_SC_PAGESIZE));
+	pthread_key_create(&cache_key, cache_destroy);
+	__atomic_store_n(&Buddy_Is_Init, 1, __ATOMIC_RELEASE);
+	lock_release(&lock, held);
+}
+
+// returns the whole block of a new superblock of
+// `arena` that fits a block of `order`, not in any
+// free list
+static struct block *grow(struct arena *arena, size_t order)
+{
+	struct superblock *sb;
+	byte_t *base;
+	int held;
+
+	if (order < SUPERBLOCKORDER) {
+		order = SUPERBLOCKORDER;
+	}
+	if (order >= NORDERS - 1) {
+		return BNULL;
+	}
+
+	// metadata is zeroed, so the tree starts out
+	// as one free block
+	sb = map(METASIZE(order));
+	if (sb == BNULL) {
+		return BNULL;
+	}
+
+	// superblocks are aligned to SUPERBLOCKORDER
+	// so the superblock table can find them
+	base = map_aligned(SIZE(order), SIZE(SUPERBLOCKORDER));
+	if (base == BNULL) {
+		munmap(sb, METASIZE(order));
+		return BNULL;
+	}
+
+	sb->arena = arena;
+	sb->base = base;
+	sb->order = order;
+	held = lock_acquire(&lock);
+	if (register_superblock(sb) < 0) {
+		unregister_superblock(sb);
+		lock_release(&lock, held);
+		munmap(base, SIZE(order));
+		munmap(sb, METASIZE(order));
+		return BNULL;
+	}
+	lock_release(&lock, held);
+	// the lock-free heap grows without the arena lock
+	__atomic_fetch_add(&arena->superblocks, 1, __ATOMIC_RELAXED);
+
+	return (struct block *) base;
+}
+
+#ifndef BUDDY_LOCKFREE
+
+// give the empty superblock `sb` back to the kernel,
+// the lock of its arena must be held
+static void release(struct superblock *sb)
+{
+	int held;
+
+	sb->arena->superblocks--;
+	held = lock_acquire(&lock);
+	unregister_superblock(sb);
+	lock_release(&lock, held);
+	munmap(sb->base, SIZE(sb->order));
+	munmap(sb, METASIZE(sb->order));
+}
+
+// coalesce `block` of `*order` with its free buddies,
+// the free buddies are taken out of their free lists and
+// the bytes of them that may be resident, their first
+// page and what wasn't purged past it, are added to
+// `*resident`
+static struct block *join(struct superblock *sb, struct block *block,
+			  size_t *order, size_t *resident)
+{
+	struct block *buddy;
+	size_t size;
+
+	for (; *order < sb->order; (*order)++) {
+		size = SIZE(*order);
+		buddy = OFFSET(sb->base, BYTEDIFF(sb->base, block) ^ size);
+
+		// a zero node is a free block of this size,
+		// no need to look at the buddy itself
+		if (sb->tree[NODE(sb, buddy, *order)] != 0) {
+			break;
+		}
+		remove_free(sb->arena, buddy, *order);
+		if (*order > page_order) {
+			*resident += SIZE(page_order) +
+			    ((struct large_block *) buddy)->resident;
+		} else {
+			*resident += size;
+		}
+		if (buddy < block) {
+			block = buddy;
+		}
+	}
+
+	return block;
+}
+
+// returns a free block of `order` from `arena`, not in
+// any free list and not marked used yet, the arena lock
+// must be held, `dirty` is set to how many bytes at its
+// start may not be zero and `resident` and `freed_at` to
+// the purge state of the block it was split from
+static struct block *take_block(struct arena *arena, size_t order,
+				size_t *dirty, size_t *resident,
+				uint64_t *freed_at)
+{
+	size_t fits, block_order;
+	struct block *block;
+
+	// take the smallest free block that fits
+	*freed_at = 0;
+	fits = arena->free_mask >> order;
+	if (fits > 0) {
+		block_order = order + __builtin_ctzl(fits);
+		block = arena->free_lists[block_order];
+		remove_free(arena, block, block_order);
+		*resident = SIZE(block_order);
+		*dirty = SIZE(block_order);
+		if (block_order > page_order) {
+			*resident = ((struct large_block *) block)->resident;
+			*freed_at = ((struct large_block *) block)->freed_at;
+			// only the first page of a purged block was used
+			if (*resident == 0) {
+				*dirty = SIZE(page_order);
+			}
+		}
+	} else {
+		block = grow(arena, order);
+		if (block == BNULL) {
+			return BNULL;
+		}
+		block_order = superblock_of(block)->order;
+		*resident = 0;
+		*dirty = 0;
+	}
+
+	// split until we have best fit, the halves keep the
+	// purge state of the block
+	while (block_order > order) {
+		block_order--;
+		push_free(arena, OFFSET(block, SIZE(block_order)),
+			  block_order, *resident, *freed_at);
+	}
+	return block;
+}
+
+// returns a block of `order` from `arena` marked used
+// in the tree, the arena lock must be held, `dirty`
+// is set to how many bytes at its start may not be zero
+static struct block *alloc_block(struct arena *arena, size_t order,
+				 size_t *dirty)
+{
+	struct block *block;
+	uint64_t freed_at;
+	size_t resident;
+
+	block = take_block(arena, order, dirty, &resident, &freed_at);
+	if (block == BNULL) {
+		return BNULL;
+	}
+	tree_set(superblock_of(block), block, order, order, TREE_USED);
+	tick(arena);
+	return block;
+}
+
+// allocate `count` blocks of `order` from `arena` into
+// `ptrs`, carved side by side out of one block large
+// enough for all of them, what is left of it goes back
+// to the free lists, the arena lock must be held,
+// returns how many were allocated
+static size_t alloc_blocks(struct arena *arena, size_t order,
+			   size_t count, void **ptrs)
+{
+	struct superblock *sb;
+	struct block *block;
+	uint64_t freed_at;
+	size_t done = 0, levels, take, pos, run, dirty, resident;
+
+	while (done < count) {
+		// the smallest block that holds the rest, at
+		// most a superblock
+		take = count - done;
+		levels = take > 1 ? NORDERS - __builtin_clzl(take - 1) : 0;
+		if (order + levels > SUPERBLOCKORDER) {
+			levels = order < SUPERBLOCKORDER ?
+			    SUPERBLOCKORDER - order : 0;
+		}
+		if (take > SIZE(levels)) {
+			take = SIZE(levels);
+		}
+
+		block = take_block(arena, order + levels, &dirty, &resident,
+				   &freed_at);
+		if (block == BNULL) {
+			break;
+		}
+		sb = superblock_of(block);
+		for (pos = 0; pos < take; pos++) {
+			ptrs[done++] = OFFSET(block, pos * SIZE(order));
+			tree_set(sb, OFFSET(block, pos * SIZE(order)), order,
+				 order, TREE_USED);
+		}
+		// the rest is split into the largest aligned
+		// blocks, which keep the purge state
+		while (pos < SIZE(levels)) {
+			run = __builtin_ctzl(pos);
+			while (pos + SIZE(run) > SIZE(levels)) {
+				run--;
+			}
+			push_free(arena, OFFSET(block, pos * SIZE(order)),
+				  order + run, resident, freed_at);
+			pos += SIZE(run);
+		}
+		tick(arena);
+	}
+	return done;
+}
+
+// give `block` of `order` back to the heap, the lock
+// of the arena of `sb` must be held
+static void free_block(struct superblock *sb,
+		       struct block *block, size_t order)
+{
+	struct arena *arena = sb->arena;
+	size_t joined_order = order, resident = SIZE(order);
+	struct block *joined = join(sb, block, &joined_order, &resident);
+
+	// clear the path up from the freed block, the joined
+	// buddies already have only zero nodes
+	tree_set(sb, block, order, joined_order, 0);
+
+	// keep one superblock around, so a loop that
+	// allocates and frees does not map it every time
+	if (joined_order == sb->order &&
+	    (sb->order > SUPERBLOCKORDER || arena->superblocks > 1)) {
+		release(sb);
+	} else {
+		// the freed block and the joined buddies cover
+		// the first page of the joined block, only what
+		// lies past it counts
+		push_free(arena, joined, joined_order,
+			  resident > SIZE(page_order) ?
+			  resident - SIZE(page_order) : 0, 0);
+	}
+	tick(arena);
+
+	if (arena->dirty_size > BUDDY_TRIM_THRESHOLD) {
+		purge(arena, 0, BUDDY_TRIM_THRESHOLD / 2, SIZE_MAX);
+	}
+}
+
+#else
+
+// a free block of `order` in `sb` may be at node `index`
+// of its level, the hint is lowered to it and searches
+// that started before fail to raise it past
+static void hint_lower(struct superblock *sb, size_t order, size_t index)
+{
+	uint64_t old = __atomic_load_n(&sb->hints[order], __ATOMIC_RELAXED);
+	uint64_t new;
+
+	do {
+		new = HINT((uint32_t) old < index ? (uint32_t) old : index,
+			   (old >> 32) + 1);
+	} while (!__atomic_compare_exchange_n(&sb->hints[order], &old, new,
+					      1, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+// a search from `hint` found no free block of `order`
+// before node `index` of its level
+static void hint_raise(struct superblock *sb, size_t order,
+		       uint64_t hint, size_t index)
+{
+	if ((uint32_t) hint < index) {
+		__atomic_compare_exchange_n(&sb->hints[order], &hint,
+					    HINT(index, hint >> 32), 0,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED);
+	}
+}
+
+// node `node` of `sb` became a free block, and so did
+// every node below it
+static void hint_free(struct superblock *sb, size_t node)
+{
+	size_t order = sb->order - DEPTH(node);
+	size_t index = node - SIZE(DEPTH(node));
+
+	for (;; order--, index *= 2) {
+		hint_lower(sb, order, index);
+		if (order == MINORDER) {
+			break;
+		}
+	}
+}
+
+// free the used block at tree node `node`, clearing the
+// marks it left on its ancestors up to node `top`
+static void node_free(struct superblock *sb, size_t node, size_t top)
+{
+	byte_t *tree = sb->tree;
+	size_t child, parent;
+	byte_t old, new;
+
+	// mark the way up as being freed, up to the first
+	// node whose other child is still used
+	for (child = node; child != top; child = parent) {
+		parent = child / 2;
+		old = __atomic_fetch_or(&tree[parent],
+					SIDE(child, NODE_COAL_LEFT),
+					__ATOMIC_ACQ_REL);
+		if (old & SIDE(child ^ 1, NODE_OCC_LEFT)) {
+			break;
+		}
+	}
+
+	__atomic_store_n(&tree[node], 0, __ATOMIC_RELEASE);
+	// an allocation that is rolled back frees nodes under
+	// a used block, which searches can't take anyway
+	if (top == 1) {
+		hint_free(sb, node);
+	}
+
+	// clear the marks, an allocation that took a node on
+	// the way clears its mark and keeps the rest
+	for (child = node; child != top; child = parent) {
+		parent = child / 2;
+		old = __atomic_load_n(&tree[parent], __ATOMIC_RELAXED);
+		do {
+			if (!(old & SIDE(child, NODE_COAL_LEFT))) {
+				return;
+			}
+			new = old & ~(SIDE(child, NODE_COAL_LEFT) |
+				      SIDE(child, NODE_OCC_LEFT));
+		} while (!__atomic_compare_exchange_n(&tree[parent], &old, new,
+						      1, __ATOMIC_ACQ_REL,
+						      __ATOMIC_RELAXED));
+		if (new & SIDE(child ^ 1, NODE_OCC_LEFT)) {
+			return;
+		}
+		if (new == 0 && top == 1) {
+			// the buddies joined into a free block
+			hint_lower(sb, sb->order - DEPTH(parent),
+				   parent - SIZE(DEPTH(parent)));
+		}
+	}
+}
+
+// take the free node `node` and mark its ancestors, returns
+// 0 or the node that made it fail, `node` itself when it
+// wasn't free or an ancestor that is a used block
+static size_t node_take(struct superblock *sb, size_t node)
+{
+	byte_t *tree = sb->tree;
+	byte_t old = 0, new;
+	size_t child, parent;
+
+	if (!__atomic_compare_exchange_n(&tree[node], &old, NODE_BUSY, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		return node;
+	}
+
+	for (child = node; child > 1; child = parent) {
+		parent = child / 2;
+		old = __atomic_load_n(&tree[parent], __ATOMIC_RELAXED);
+		do {
+			if (old & NODE_OCC) {
+				// undo the marks made so far
+				node_free(sb, node, child);
+				return parent;
+			}
+			new = (old & ~SIDE(child, NODE_COAL_LEFT)) |
+			    SIDE(child, NODE_OCC_LEFT);
+		} while (!__atomic_compare_exchange_n(&tree[parent], &old, new,
+						      1, __ATOMIC_ACQ_REL,
+						      __ATOMIC_RELAXED));
+	}
+	return 0;
+}
+
+// returns a block of `order` from `sb` or BNULL, the
+// search starts at the hint of `order` and raises it past
+// the used nodes it finds, so a superblock that is full
+// for `order` is passed over at once
+static struct block *sb_alloc(struct superblock *sb, size_t order)
+{
+	size_t first = SIZE(sb->order - order);
+	uint64_t hint = __atomic_load_n(&sb->hints[order], __ATOMIC_ACQUIRE);
+	size_t i, node, failed;
+
+	for (i = (uint32_t) hint; i < first; i++) {
+		node = first + i;
+		if (__atomic_load_n(&sb->tree[node], __ATOMIC_RELAXED) != 0) {
+			continue;
+		}
+		failed = node_take(sb, node);
+		if (failed == 0) {
+			hint_raise(sb, order, hint, i + 1);
+			return OFFSET(sb->base, i << order);
+		}
+		// skip the rest of the used block above
+		if (failed != node) {
+			size_t levels = __builtin_clzl(failed) -
+			    __builtin_clzl(node);
+			i += ((failed + 1) << levels) - node - 1;
+		}
+	}
+	hint_raise(sb, order, hint, first);
+	return BNULL;
+}
+
+// returns a block of `order` marked used in the tree,
+// `dirty` is set to how many bytes at its start may
+// not be zero
+static struct block *alloc_block(struct arena *arena, size_t order,
+				 size_t *dirty)
+{
+	struct superblock *head, *sb = thread_superblock;
+	struct block *block;
+
+	*dirty = SIZE(order);
+	if (sb != BNULL && sb->order >= order) {
+		block = sb_alloc(sb, order);
+		if (block != BNULL) {
+			return block;
+		}
+	}
+
+	for (;;) {
+		head = __atomic_load_n(&heap, __ATOMIC_ACQUIRE);
+		for (sb = head; sb != BNULL; sb = sb->next) {
+			if (sb->order < order || sb == thread_superblock) {
+				continue;
+			}
+			block = sb_alloc(sb, order);
+			if (block != BNULL) {
+				thread_superblock = sb;
+				return block;
+			}
+		}
+
+		// every superblock is full, unless one was
+		// added while looking
+		if (__atomic_load_n(&heap, __ATOMIC_ACQUIRE) != head) {
+			continue;
+		}
+		block = grow(arena, order);
+		if (block == BNULL) {
+			return BNULL;
+		}
+		sb = superblock_of(block);
+		sb->next = __atomic_load_n(&heap, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&heap, &sb->next, sb, 1,
+						    __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED)) {
+		}
+		thread_superblock = BNULL;
+	}
+}
+
+static void free_block(struct superblock *sb,
+		       struct block *block, size_t order)
+{
+	node_free(sb, NODE(sb, block, order), 1);
+}
+
+// allocate `count` blocks of `order` into `ptrs`, one at
+// a time, the lock-free heap has no free lists to carve
+// them from, returns how many were allocated
+static size_t alloc_blocks(struct arena *arena, size_t order,
+			   size_t count, void **ptrs)
+{
+	size_t done, dirty;
+
+	for (done = 0; done < count; done++) {
+		ptrs[done] = alloc_block(arena, order, &dirty);
+		if (ptrs[done] == BNULL) {
+			break;
+		}
+	}
+	return done;
+}
+
+#endif
+
+// the offset of the first object in a slab of `size_class`,
+// objects are aligned to the largest power of two their size
+// is a multiple of, so baligned_alloc can hand them out
+static size_t slab_start(size_t size_class)
+{
+	size_t align = class_sizes[size_class] & -class_sizes[size_class];
+
+	return (offsetof(struct slab, objects) + align - 1) & ~(align - 1);
+}
+
+// the number of objects in a slab of `size_class`
+static size_t slab_capacity(size_t size_class)
+{
+	return (SIZE(SLABORDER) - slab_start(size_class)) /
+	    class_sizes[size_class];
+}
+
+// returns a free object of `size_class` from `arena`,
+// the lock of the class must be held
+static void *slab_alloc(struct arena *arena, size_t size_class)
+{
+	struct slab_class *sc = &arena->classes[size_class];
+	struct slab *slab = sc->slabs;
+	size_t count = slab_capacity(size_class);
+	size_t word, bit, dirty;
+	int held;
+
+	if (slab == BNULL) {
+		held = heap_acquire(arena);
+		slab = (struct slab *) alloc_block(arena, SLABORDER, &dirty);
+		if (slab != BNULL) {
+			mark_slab(superblock_of(slab), slab);
+		}
+		heap_release(arena, held);
+		if (slab == BNULL) {
+			return BNULL;
+		}
+
+		// objects past the end of the slab are
+		// marked used, so they are never found
+		memset(slab->bitmap, 0, sizeof(slab->bitmap));
+		for (size_t i = count; i < sizeof(slab->bitmap) * 8; i++) {
+			slab->bitmap[i / 64] |= (uint64_t) 1 << (i % 64);
+		}
+		slab->arena = arena;
+		slab->size_class = size_class;
+		slab->used = 0;
+		slab->prev = BNULL;
+		slab->next = BNULL;
+		sc->slabs = slab;
+	}
+
+	word = 0;
+	while (slab->bitmap[word] == ~(uint64_t) 0) {
+		word++;
+	}
+	bit = __builtin_ctzll(~slab->bitmap[word]);
+	slab->bitmap[word] |= (uint64_t) 1 << bit;
+
+	// a full slab leaves the list
+	if (++slab->used == count) {
+		sc->slabs = slab->next;
+		if (slab->next != BNULL) {
+			slab->next->prev = BNULL;
+		}
+	}
+
+	return (byte_t *) slab + slab_start(size_class) +
+	    (word * 64 + bit) * class_sizes[size_class];
+}
+
+// give the slab object at `ptr` back to its slab, the
+// lock of its class in the arena of the slab must be held
+static void slab_free(struct superblock *sb, void *ptr)
+{
+	struct slab *slab = SLAB(ptr);
+	struct arena *arena = slab->arena;
+	struct slab_class *sc = &arena->classes[slab->size_class];
+	size_t index = (BYTEDIFF(slab, ptr) - slab_start(slab->size_class)) /
+	    class_sizes[slab->size_class];
+	int full = slab->used == slab_capacity(slab->size_class);
+	int held;
+
+	slab->bitmap[index / 64] &= ~((uint64_t) 1 << (index % 64));
+	slab->used--;
+
+	if (full) {
+		// a slab with free objects goes back on the list
+		slab->prev = BNULL;
+		slab->next = sc->slabs;
+		if (slab->next != BNULL) {
+			slab->next->prev = slab;
+		}
+		sc->slabs = slab;
+	} else if (slab->used == 0 &&
+		   (slab->prev != BNULL || slab->next != BNULL)) {
+		// an empty slab is given back, unless it is
+		// the last one of its class
+		if (slab->prev != BNULL) {
+			slab->prev->next = slab->next;
+		} else {
+			sc->slabs = slab->next;
+		}
+		if (slab->next != BNULL) {
+			slab->next->prev = slab->prev;
+		}
+		held = heap_acquire(arena);
+		free_block(sb, (struct block *) slab, SLABORDER);
+		heap_release(arena, held);
+	}
+}
+
+// returns an object of the kind of cache bin `bin`,
+// `bin` must be locked in `arena`
+static void *bin_alloc(struct arena *arena, size_t bin)
+{
+	size_t dirty;
+
+	if (bin < NCLASSES) {
+		return slab_alloc(arena, bin);
+	}
+	return alloc_block(arena, bin - NCLASSES + CACHEMINORDER, &dirty);
+}
+
+// give `ptr` of the kind of cache bin `bin` back to
+// the heap, `bin` must be locked in the arena `ptr`
+// belongs to
+static void bin_free(struct superblock *sb, void *ptr, size_t bin)
+{
+	if (bin < NCLASSES) {
+		slab_free(sb, ptr);
+	} else {
+		free_block(sb, ptr, bin - NCLASSES + CACHEMINORDER);
+	}
+}
+
+// copy `size` bytes between blocks that don't overlap
+static void copy(void *dst, const void *src, size_t size)
+{
+#ifdef __SSE2__
+	if (size >= STREAMSIZE) {
+		byte_t *d = dst;
+		const byte_t *s = src;
+		// stores must be aligned, loads needn't be
+		size_t head = -(uintptr_t) d & 15;
+
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		size -= head;
+		for (; size >= 64; size -= 64, d += 64, s += 64) {
+			__m128i a = _mm_loadu_si128((const __m128i *) s);
+			__m128i b = _mm_loadu_si128((const __m128i *) (s + 16));
+			__m128i c = _mm_loadu_si128((const __m128i *) (s + 32));
+			__m128i e = _mm_loadu_si128((const __m128i *) (s + 48));
+			_mm_stream_si128((__m128i *) d, a);
+			_mm_stream_si128((__m128i *) (d + 16), b);
+			_mm_stream_si128((__m128i *) (d + 32), c);
+			_mm_stream_si128((__m128i *) (d + 48), e);
+		}
+		_mm_sfence();
+		memcpy(d, s, size);
+		return;
+	}
+#endif
+	memcpy(dst, src, size);
+}
+
+// map `size` bytes for a huge allocation aligned to
+// `align`, at least SUPERBLOCKORDER so it has superblock
+// table slots of its own
+static void *huge_alloc(size_t size, size_t align)
+{
+	struct superblock *sb = balloc(sizeof(*sb));
+	int held;
+
+	if (sb == BNULL) {
+		return BNULL;
+	}
+	if (align < SIZE(SUPERBLOCKORDER)) {
+		align = SIZE(SUPERBLOCKORDER);
+	}
+	size = (size + SIZE(page_order) - 1) & ~(SIZE(page_order) - 1);
+	sb->base = map_aligned(size, align);
+	if (sb->base == BNULL) {
+		bfree(sb);
+		return BNULL;
+	}
+	sb->arena = BNULL;
+	sb->order = 0;
+	sb->huge = size;
+
+	held = lock_acquire(&lock);
+	if (register_superblock(sb) < 0) {
+		unregister_superblock(sb);
+		lock_release(&lock, held);
+		munmap(sb->base, size);
+		bfree(sb);
+		return BNULL;
+	}
+	lock_release(&lock, held);
+	return sb->base;
+}
+
+#ifdef MREMAP_MAYMOVE
+// resize the huge allocation of `sb` to `size` bytes,
+// the kernel moves its pages when it can't grow in place
+static void *huge_realloc(struct superblock *sb, size_t size)
+{
+	byte_t *base = sb->base;
+	int ok, held;
+
+	size = (size + SIZE(page_order) - 1) & ~(SIZE(page_order) - 1);
+	if (size == sb->huge) {
+		return base;
+	}
+
+	// the table must have room for the new slots
+	// before the pages move, so it can't fail after
+	held = lock_acquire(&lock);
+	ok = add_leaves((uintptr_t) base >> SUPERBLOCKORDER,
+			(size + SIZE(SUPERBLOCKORDER) - 1) >> SUPERBLOCKORDER);
+	lock_release(&lock, held);
+	if (ok < 0) {
+		return BNULL;
+	}
+
+	if (mremap(base, sb->huge, size, 0) == MAP_FAILED) {
+		// move the pages over an aligned reservation
+		base = map_aligned(size, SIZE(SUPERBLOCKORDER));
+		if (base == BNULL) {
+			return BNULL;
+		}
+		held = lock_acquire(&lock);
+		ok = add_leaves((uintptr_t) base >> SUPERBLOCKORDER,
+				(size + SIZE(SUPERBLOCKORDER) - 1) >>
+				SUPERBLOCKORDER);
+		lock_release(&lock, held);
+		if (ok < 0 ||
+		    mremap(sb->base, sb->huge, size,
+			   MREMAP_MAYMOVE | MREMAP_FIXED, base) == MAP_FAILED) {
+			munmap(base, size);
+			return BNULL;
+		}
+	}
+
+	held = lock_acquire(&lock);
+	unregister_superblock(sb);
+	sb->base = base;
+	sb->huge = size;
+	register_superblock(sb);
+	lock_release(&lock, held);
+	return base;
+}
+#endif
+
+static void huge_free(struct superblock *sb)
+{
+	int held;
+
+	held = lock_acquire(&lock);
+	unregister_superblock(sb);
+	lock_release(&lock, held);
+	munmap(sb->base, sb->huge);
+	bfree(sb);
+}
+
+#ifndef BUDDY_LOCKFREE
+
+// queue the block at `ptr` of `order` to be freed by
+// the next thread that locks the blocks of `arena`, a
+// single CAS instead of waiting for the lock
+static void remote_push(struct arena *arena, void *ptr, size_t order)
+{
+	struct remote_block *block = ptr;
+
+	block->order = order;
+	block->next = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&arena->remote, &block->next,
+					    block, 1, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED)) {
+	}
+}
+
+// free the blocks queued for `arena`, the arena lock
+// must be held
+static void remote_drain(struct arena *arena)
+{
+	struct remote_block *block, *next;
+
+	if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == BNULL) {
+		return;
+	}
+	// pushers only ever add to the head, so taking
+	// the whole queue at once is safe
+	block = __atomic_exchange_n(&arena->remote, BNULL, __ATOMIC_ACQUIRE);
+	for (; block != BNULL; block = next) {
+		next = block->next;
+		free_block(superblock_of(block), (struct block *) block,
+			   block->order);
+	}
+}
+
+#endif
+
+// lock what guards objects of cache bin `bin` in `arena`,
+// its blocks when `bin` is NBINS, returns what
+// bin_release takes
+static int bin_acquire(struct arena *arena, size_t bin)
+{
+	if (bin < NCLASSES) {
+		return lock_acquire(&arena->classes[bin].lock);
+	}
+	return heap_acquire(arena);
+}
+
+static int bin_try(struct arena *arena, size_t bin, int *held)
+{
+	if (bin < NCLASSES) {
+		return lock_try(&arena->classes[bin].lock, held);
+	}
+	return heap_try(arena, held);
+}
+
+static void bin_release(struct arena *arena, size_t bin, int held)
+{
+	if (bin < NCLASSES) {
+		lock_release(&arena->classes[bin].lock, held);
+	} else {
+		heap_release(arena, held);
+	}
+}
+
+// the arena that the object of cache bin `bin` at `ptr`
+// in `sb` goes back to
+static struct arena *arena_of(struct superblock *sb, void *ptr, size_t bin)
+{
+	return bin < NCLASSES ? SLAB(ptr)->arena : sb->arena;
+}
+
+// register the cache of this thread to be flushed
+// when it exits, the cache is active first since
+// pthread_setspecific may allocate and get here again
+static void cache_register(void)
+{
+	cache.state = CACHE_ACTIVE;
+	pthread_setspecific(cache_key, &cache);
+}
+
+// lock the arena of the calling thread for objects of
+// `bin`, a thread that finds its arena contended moves
+// on to the next one, `*held` is set to what
+// bin_release takes
+static struct arena *arena_lock(size_t bin, int *held)
+{
+	struct arena *arena = thread_arena;
+
+	if (arena == BNULL || !bin_try(arena, bin, held)) {
+		if (arena == BNULL) {
+			// so its arena is drained when it exits
+			if (cache.state == CACHE_NEW) {
+				cache_register();
+			}
+			arena = &arenas[__atomic_fetch_add(&next_arena, 1,
+							   __ATOMIC_RELAXED) %
+					NARENAS];
+		} else {
+			arena = &arenas[(arena - arenas + 1) % NARENAS];
+		}
+		thread_arena = arena;
+		*held = bin_acquire(arena, bin);
+	}
+	return arena;
+}
+
+// give `ptr` of `bin` back to the arena it came from,
+// `*locked` is the arena whose lock for `bin` is held,
+// with `*held` from bin_acquire, objects of one arena
+// tend to come in runs so its lock is kept until the
+// arena changes
+static void give_back(void *ptr, size_t bin, struct arena **locked,
+		      int *held)
+{
+	struct superblock *sb = superblock_of(ptr);
+	struct arena *arena = arena_of(sb, ptr, bin);
+
+	if (arena != *locked) {
+		if (*locked != BNULL) {
+			bin_release(*locked, bin, *held);
+		}
+		*locked = arena;
+		*held = bin_acquire(arena, bin);
+	}
+	bin_free(sb, ptr, bin);
+}
+
+// give `count` objects of `bin` from the cache
+// back to the arenas they came from
+static void cache_flush(size_t bin, size_t count)
+{
+	struct block *block;
+	struct arena *locked = BNULL;
+	int locked_held = 0;
+
+	for (; count > 0; count--) {
+		block = cache.lists[bin];
+		cache.lists[bin] = block->next;
+		cache.counts[bin]--;
+		give_back(block, bin, &locked, &locked_held);
+	}
+	if (locked != BNULL) {
+		bin_release(locked, bin, locked_held);
+	}
+}
+
+// thread exit destructor of cache_key
+static void cache_destroy(void *arg)
+{
+	(void) arg;
+	for (size_t bin = 0; bin < NBINS; bin++) {
+		cache_flush(bin, cache.counts[bin]);
+	}
+#ifndef BUDDY_LOCKFREE
+	// no allocation of this thread will free the
+	// blocks queued for its arena any more
+	if (thread_arena != BNULL) {
+		int held = heap_acquire(thread_arena);
+
+		heap_release(thread_arena, held);
+	}
+#endif
+	// later frees on this thread go to the heap
+	cache.state = CACHE_DEAD;
+}
+
+#ifdef PERCPU
+
+// the descriptor of a restartable sequence from 1 to
+// its commit at 2, a thread that is preempted or moved
+// to another CPU in between restarts at 4, behind the
+// signature the kernel checks, which jumps to `restart`,
+// the sequence starts with %rax at the bin of `bin` of the
+// CPU and jumps to `miss` when the CPU has no cache
+#define RSEQ_START\
+	".pushsection __rseq_cs, \"aw\"\n\t"\
+	".balign 32\n\t"\
+	"3:\n\t"\
+	".long 0, 0\n\t"\
+	".quad 1f, 2f - 1f, 4f\n\t"\
+	".popsection\n\t"\
+	"leaq 3b(%%rip), %%rax\n\t"\
+	"movq %%rax, %c[cs](%[rs])\n\t"\
+	"1:\n\t"\
+	"movl %c[cpu](%[rs]), %%eax\n\t"\
+	"cmpl %[ncpus], %%eax\n\t"\
+	"jae %l[miss]\n\t"\
+	"movq (%[caches], %%rax, 8), %%rax\n\t"\
+	"testq %%rax, %%rax\n\t"\
+	"jz %l[miss]\n\t"\
+	"addq %[bin], %%rax\n\t"
+#define RSEQ_END\
+	"2:\n\t"\
+	".pushsection __rseq_failure, \"ax\"\n\t"\
+	".byte 0x0f, 0xb9, 0x3d\n\t"\
+	".long %c[sig]\n\t"\
+	"4:\n\t"\
+	"jmp %l[restart]\n\t"\
+	".popsection\n\t"
+// the operands RSEQ_START and RSEQ_END use
+#define RSEQ_INPUTS(bin)\
+	[rs] "r" (rseq_area()),\
+	[caches] "r" (cpu_caches),\
+	[bin] "r" ((bin) * sizeof(struct cpu_bin)),\
+	[ncpus] "i" (NCPUS),\
+	[cs] "i" (offsetof(struct rseq, rseq_cs)),\
+	[cpu] "i" (offsetof(struct rseq, cpu_id)),\
+	[sig] "i" (RSEQ_SIG)
+
+// the restartable sequence area glibc registered
+// for the calling thread
+static struct rseq *rseq_area(void)
+{
+	return (struct rseq *) ((byte_t *) __builtin_thread_pointer() +
+				__rseq_offset);
+}
+
+// the CPU the calling thread runs on, NCPUS or more
+// when it has no restartable sequence area
+static uint32_t rseq_cpu(void)
+{
+	if (__rseq_size == 0) {
+		return UINT32_MAX;
+	}
+	return __atomic_load_n(&rseq_area()->cpu_id, __ATOMIC_RELAXED);
+}
+
+// the cache of the CPU the calling thread runs on, mapped
+// by the first thread to need it, BNULL when there is none
+static struct cpu_cache *cpu_cache(void)
+{
+	uint32_t cpu = rseq_cpu();
+	struct cpu_cache *c, *expected = BNULL;
+
+	if (cpu >= NCPUS) {
+		return BNULL;
+	}
+	c = __atomic_load_n(&cpu_caches[cpu], __ATOMIC_ACQUIRE);
+	if (c == BNULL) {
+		c = map(sizeof(*c));
+		if (c == BNULL) {
+			return BNULL;
+		}
+		if (!__atomic_compare_exchange_n(&cpu_caches[cpu], &expected,
+						 c, 0, __ATOMIC_RELEASE,
+						 __ATOMIC_ACQUIRE)) {
+			munmap(c, sizeof(*c));
+			c = expected;
+		}
+	}
+	return c;
+}
+
+// take an object of `bin` from the cache of the CPU,
+// BNULL when it is empty or there is none
+static void *cpu_pop(size_t bin)
+{
+	void *ptr;
+
+restart:
+	__asm__ goto(RSEQ_START
+		     "movq (%%rax), %%rcx\n\t"
+		     "testq %%rcx, %%rcx\n\t"
+		     "jz %l[miss]\n\t"
+		     "movq (%%rax, %%rcx, 8), %%rdx\n\t"
+		     "movq %%rdx, (%[ptr])\n\t"
+		     "decq %%rcx\n\t"
+		     "movq %%rcx, (%%rax)\n\t"
+		     RSEQ_END
+		     :
+		     : RSEQ_INPUTS(bin), [ptr] "r" (&ptr)
+		     : "rax", "rcx", "rdx", "cc", "memory"
+		     : restart, miss);
+	return ptr;
+miss:
+	return BNULL;
+}
+
+// put `ptr` of `bin` in the cache of the CPU, returns 0
+// when it is full or there is none
+static int cpu_push(size_t bin, void *ptr)
+{
+restart:
+	__asm__ goto(RSEQ_START
+		     "movq (%%rax), %%rcx\n\t"
+		     "cmpq %[slots], %%rcx\n\t"
+		     "jae %l[miss]\n\t"
+		     "movq %[ptr], 8(%%rax, %%rcx, 8)\n\t"
+		     "incq %%rcx\n\t"
+		     "movq %%rcx, (%%rax)\n\t"
+		     RSEQ_END
+		     :
+		     : RSEQ_INPUTS(bin), [ptr] "r" (ptr),
+		       [slots] "i" (CPUSLOTS)
+		     : "rax", "rcx", "cc", "memory"
+		     : restart, miss);
+	return 1;
+miss:
+	return 0;
+}
+
+// cache_alloc through the cache of the CPU, which is
+// refilled from the arena when it is empty
+static void *cpu_alloc(size_t bin)
+{
+	void *batch[CACHEBATCH];
+	struct arena *arena, *locked = BNULL;
+	size_t count = 0;
+	int held, locked_held = 0;
+	void *ptr = cpu_pop(bin);
+
+	if (ptr != BNULL) {
+		return ptr;
+	}
+
+	arena = arena_lock(bin, &held);
+	for (; count < CACHEBATCH; count++) {
+		batch[count] = bin_alloc(arena, bin);
+		if (batch[count] == BNULL) {
+			break;
+		}
+	}
+	bin_release(arena, bin, held);
+	if (count == 0) {
+		return BNULL;
+	}
+
+	ptr = batch[--count];
+	if (cpu_cache() != BNULL) {
+		while (count > 0 && cpu_push(bin, batch[count - 1])) {
+			count--;
+		}
+	}
+	// what doesn't fit, as other threads on the CPU
+	// filled it meanwhile, goes back
+	while (count > 0) {
+		give_back(batch[--count], bin, &locked, &locked_held);
+	}
+	if (locked != BNULL) {
+		bin_release(locked, bin, locked_held);
+	}
+	return ptr;
+}
+
+// cache_free through the cache of the CPU, half of
+// which goes back to the arenas when it is full
+static void cpu_free(void *ptr, size_t bin)
+{
+	struct arena *locked = BNULL;
+	int locked_held = 0;
+	void *old;
+
+	if (cpu_push(bin, ptr)) {
+		return;
+	}
+	if (cpu_cache() != BNULL) {
+		for (size_t i = 0; i < CACHEBATCH; i++) {
+			old = cpu_pop(bin);
+			if (old == BNULL) {
+				break;
+			}
+			give_back(old, bin, &locked, &locked_held);
+		}
+		if (cpu_push(bin, ptr)) {
+			ptr = BNULL;
+		}
+	}
+	if (ptr != BNULL) {
+		give_back(ptr, bin, &locked, &locked_held);
+	}
+	if (locked != BNULL) {
+		bin_release(locked, bin, locked_held);
+	}
+}
+
+#endif
+
+// take an object of `bin` from the cache, threads with a
+// restartable sequence use the cache of their CPU
+static void *cache_alloc(size_t bin)
+{
+	struct block *block;
+	struct arena *arena;
+	int held;
+
+#ifdef PERCPU
+	if (rseq_cpu() < NCPUS) {
+		return cpu_alloc(bin);
+	}
+#endif
+	if (cache.lists[bin] == BNULL) {
+		if (cache.state == CACHE_NEW) {
+			cache_register();
+		}
+		arena = arena_lock(bin, &held);
+		for (size_t i = 0; i < CACHEBATCH; i++) {
+			block = bin_alloc(arena, bin);
+			if (block == BNULL) {
+				break;
+			}
+			block->next = cache.lists[bin];
+			cache.lists[bin] = block;
+			cache.counts[bin]++;
+		}
+		bin_release(arena, bin, held);
+		if (cache.lists[bin] == BNULL) {
+			return BNULL;
+		}
+	}
+
+	block = cache.lists[bin];
+	cache.lists[bin] = block->next;
+	cache.counts[bin]--;
+	return block;
+}
+
+static void cache_free(void *ptr, size_t bin)
+{
+	struct block *block = ptr;
+
+#ifdef PERCPU
+	if (rseq_cpu() < NCPUS) {
+		cpu_free(ptr, bin);
+		return;
+	}
+#endif
+	if (cache.state == CACHE_NEW) {
+		cache_register();
+	}
+	block->next = cache.lists[bin];
+	cache.lists[bin] = block;
+	if (++cache.counts[bin] > 2 * CACHEBATCH) {
+		cache_flush(bin, CACHEBATCH);
+	}
+}
+
+// returns a block of `order`, through the thread cache
+// when it keeps blocks of `order`, `dirty` is set to how
+// many bytes at its start may not be zero
+static void *alloc_order(size_t order, size_t *dirty)
+{
+	size_t bin = NCLASSES + order - CACHEMINORDER;
+	struct arena *arena;
+	void *ptr;
+	int held;
+
+	if (order >= CACHEMINORDER && order <= CACHEMAXORDER) {
+		*dirty = SIZE(order);
+		if (cache.state != CACHE_DEAD) {
+			return cache_alloc(bin);
+		}
+		arena = arena_lock(bin, &held);
+		ptr = bin_alloc(arena, bin);
+		bin_release(arena, bin, held);
+		return ptr;
+	}
+
+	arena = arena_lock(NBINS, &held);
+	ptr = alloc_block(arena, order, dirty);
+	heap_release(arena, held);
+	return ptr;
+}
+
+// balloc, `dirty` is set to how many bytes at the
+// start of the memory may not be zero
+static void *allocate(size_t size, size_t *dirty)
+{
+	if (!__atomic_load_n(&Buddy_Is_Init, __ATOMIC_ACQUIRE)) {
+		init();
+	}
+
+	if (size == 0 || size > SIZE_MAX / 2) {
+		return BNULL;
+	}
+
+	size_t bin;
+	void *ptr;
+	struct arena *arena;
+	int held;
+
+	if (size >= BUDDY_MMAP_THRESHOLD) {
+		// fresh from the kernel
+		*dirty = 0;
+		return huge_alloc(size, 0);
+	}
+
+	if (size > SLABMAX) {
+		return alloc_order(order_of(size), dirty);
+	}
+
+	*dirty = size;
+	bin = class_of(size);
+	if (cache.state != CACHE_DEAD) {
+		return cache_alloc(bin);
+	}
+	arena = arena_lock(bin, &held);
+	ptr = bin_alloc(arena, bin);
+	bin_release(arena, bin, held);
+	return ptr;
+}
+
+// zero `size` bytes at `ptr`
+static void zero(void *ptr, size_t size)
+{
+#ifdef __SSE2__
+	if (size >= STREAMSIZE) {
+		byte_t *d = ptr;
+		size_t head = -(uintptr_t) d & 15;
+		__m128i z = _mm_setzero_si128();
+
+		memset(d, 0, head);
+		d += head;
+		size -= head;
+		for (; size >= 64; size -= 64, d += 64) {
+			_mm_stream_si128((__m128i *) d, z);
+			_mm_stream_si128((__m128i *) (d + 16), z);
+			_mm_stream_si128((__m128i *) (d + 32), z);
+			_mm_stream_si128((__m128i *) (d + 48), z);
+		}
+		_mm_sfence();
+		memset(d, 0, size);
+		return;
+	}
+#endif
+	memset(ptr, 0, size);
+}
+
+// free `ptr`, an object of `bin` or a block of `order`
+// when `bin` is NBINS, `sb` is looked up when it is BNULL
+// and the memory doesn't go to the thread cache
+static void deallocate(struct superblock *sb, void *ptr,
+		       size_t order, size_t bin)
+{
+	struct arena *arena;
+	int held;
+
+	if (bin < NBINS && cache.state != CACHE_DEAD) {
+		cache_free(ptr, bin);
+		return;
+	}
+
+	if (sb == BNULL) {
+		sb = superblock_of(ptr);
+	}
+	// free_block may release `sb`
+	arena = arena_of(sb, ptr, bin);
+#ifndef BUDDY_LOCKFREE
+	// a block of another arena goes to its remote queue
+	// rather than contending for its lock
+	if (bin == NBINS && arena != thread_arena && !single_threaded()) {
+		remote_push(arena, ptr, order);
+		return;
+	}
+#endif
+	held = bin_acquire(arena, bin);
+	if (bin < NBINS) {
+		bin_free(sb, ptr, bin);
+	} else {
+		free_block(sb, ptr, order);
+	}
+	bin_release(arena, bin, held);
+}
+
+// free a block of `order` through the thread cache
+// when it keeps blocks of `order`
+static void free_order(void *ptr, size_t order)
+{
+	if (order >= CACHEMINORDER && order <= CACHEMAXORDER) {
+		deallocate(BNULL, ptr, order, NCLASSES + order - CACHEMINORDER);
+	} else {
+		deallocate(BNULL, ptr, order, NBINS);
+	}
+}
+
+void *balloc(size_t size)
+{
+	size_t dirty;
+	return allocate(size, &dirty);
+}
+
+void *balloc_sized(size_t size, size_t *usable)
+{
+	size_t dirty;
+	void *ptr = allocate(size, &dirty);
+
+	// the size the request is rounded up to, as
+	// allocate rounds it
+	if (ptr == BNULL) {
+		*usable = 0;
+	} else if (size >= BUDDY_MMAP_THRESHOLD) {
+		*usable = (size + SIZE(page_order) - 1) &
+			  ~(SIZE(page_order) - 1);
+	} else if (size > SLABMAX) {
+		*usable = SIZE(order_of(size));
+	} else {
+		*usable = class_sizes[class_of(size)];
+	}
+	return ptr;
+}
+
+size_t balloc_batch(size_t size, size_t n, void **ptrs)
+{
+	struct arena *arena;
+	size_t bin, count = 0;
+	int held;
+
+	if (!__atomic_load_n(&Buddy_Is_Init, __ATOMIC_ACQUIRE)) {
+		init();
+	}
+
+	if (size == 0 || size > SIZE_MAX / 2) {
+		return 0;
+	}
+
+	if (size >= BUDDY_MMAP_THRESHOLD) {
+		// each gets a mapping of its own
+		for (; count < n; count++) {
+			ptrs[count] = huge_alloc(size, 0);
+			if (ptrs[count] == BNULL) {
+				break;
+			}
+		}
+		return count;
+	}
+
+	if (size > SLABMAX) {
+		arena = arena_lock(NBINS, &held);
+		count = alloc_blocks(arena, order_of(size), n, ptrs);
+		heap_release(arena, held);
+		return count;
+	}
+
+	bin = class_of(size);
+	arena = arena_lock(bin, &held);
+	for (; count < n; count++) {
+		ptrs[count] = bin_alloc(arena, bin);
+		if (ptrs[count] == BNULL) {
+			break;
+		}
+	}
+	bin_release(arena, bin, held);
+	return count;
+}
+
+void bfree(void *ptr)
+{
+	if (ptr == BNULL) {
+		return;
+	}
+
+	struct superblock *sb = superblock_of(ptr);
+
+	if (sb->huge > 0) {
+		huge_free(sb);
+		return;
+	}
+
+	// the nodes of an allocated block and below only
+	// change when it is freed, so its order can be
+	// read without the lock
+	size_t order = order_at(sb, ptr);
+	size_t bin = NBINS;
+
+	if (is_slab(sb, ptr, order)) {
+		bin = SLAB(ptr)->size_class;
+	} else if (order >= CACHEMINORDER && order <= CACHEMAXORDER) {
+		bin = NCLASSES + order - CACHEMINORDER;
+	}
+
+	deallocate(sb, ptr, order, bin);
+}
+
+void bfree_sized(void *ptr, size_t size)
+{
+	struct superblock *sb;
+
+	if (ptr == BNULL) {
+		return;
+	}
+
+	// the size tells where the memory came from the
+	// same way it told allocate, except that blocks
+	// rounded up to BUDDY_MMAP_THRESHOLD and beyond
+	// look like huge allocations
+	if (size >= BUDDY_MMAP_THRESHOLD) {
+		sb = superblock_of(ptr);
+		if (sb->huge > 0) {
+			huge_free(sb);
+		} else {
+			deallocate(sb, ptr, order_of(size), NBINS);
+		}
+		return;
+	}
+	if (size <= SLABMAX) {
+		deallocate(BNULL, ptr, 0, class_of(size));
+		return;
+	}
+	free_order(ptr, order_of(size));
+}
+
+void bfree_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+	size_t order;
+
+	if (ptr == BNULL) {
+		return;
+	}
+	if (alignment <= _Alignof(max_align_t) ||
+	    (alignment <= SLABMAX && size <= SLABMAX)) {
+		bfree_sized(ptr, (size + alignment - 1) & ~(alignment - 1));
+		return;
+	}
+
+	// the order baligned_alloc picked, alignments
+	// above SLABMAX get blocks rather than slab objects
+	order = order_of(size);
+	if (order < (size_t) __builtin_ctzl(alignment)) {
+		order = __builtin_ctzl(alignment);
+	}
+	if (SIZE(order) >= BUDDY_MMAP_THRESHOLD) {
+		huge_free(superblock_of(ptr));
+		return;
+	}
+	free_order(ptr, order);
+}
+
+// move the pointer at `root` of the max heap of `count`
+// pointers down to where it is larger than its children
+static void sift_down(void **ptrs, size_t root, size_t count)
+{
+	void *top = ptrs[root];
+	size_t child;
+
+	for (; (child = 2 * root + 1) < count; root = child) {
+		if (child + 1 < count &&
+		    (uintptr_t) ptrs[child + 1] > (uintptr_t) ptrs[child]) {
+			child++;
+		}
+		if ((uintptr_t) ptrs[child] <= (uintptr_t) top) {
+			break;
+		}
+		ptrs[root] = ptrs[child];
+	}
+	ptrs[root] = top;
+}
+
+// heapsort `count` pointers by address, qsort may
+// allocate and the caller can be malloc itself
+static void sort_pointers(void **ptrs, size_t count)
+{
+	void *top;
+
+	for (size_t root = count / 2; root-- > 0;) {
+		sift_down(ptrs, root, count);
+	}
+	for (size_t end = count; end-- > 1;) {
+		top = ptrs[0];
+		ptrs[0] = ptrs[end];
+		ptrs[end] = top;
+		sift_down(ptrs, 0, end);
+	}
+}
+
+void bfree_batch(void **ptrs, size_t n)
+{
+	struct superblock *sb;
+	struct arena *arena, *locked = BNULL;
+	size_t order, bin, locked_bin = NBINS;
+	int locked_held = 0;
+
+	// in address order the objects of a slab and the
+	// blocks of a superblock come in runs that share a
+	// lock, and buddies are freed one after the other
+	sort_pointers(ptrs, n);
+	for (size_t i = 0; i < n; i++) {
+		if (ptrs[i] == BNULL) {
+			continue;
+		}
+		sb = superblock_of(ptrs[i]);
+		if (sb->huge > 0) {
+			// the superblock of a huge allocation is a
+			// slab object, freeing it may need the lock
+			if (locked != BNULL) {
+				bin_release(locked, locked_bin, locked_held);
+				locked = BNULL;
+			}
+			huge_free(sb);
+			continue;
+		}
+
+		order = order_at(sb, ptrs[i]);
+		bin = is_slab(sb, ptrs[i], order) ?
+		    SLAB(ptrs[i])->size_class : NBINS;
+		arena = arena_of(sb, ptrs[i], bin);
+		if (arena != locked || bin != locked_bin) {
+			if (locked != BNULL) {
+				bin_release(locked, locked_bin, locked_held);
+			}
+			locked = arena;
+			locked_bin = bin;
+			locked_held = bin_acquire(locked, bin);
+		}
+		if (bin < NBINS) {
+			bin_free(sb, ptrs[i], bin);
+		} else {
+			free_block(sb, ptrs[i], order);
+		}
+	}
+	if (locked != BNULL) {
+		bin_release(locked, locked_bin, locked_held);
+	}
+}
+
+#ifndef BUDDY_LOCKFREE
+
+// resize the block of `order` at `block` in place to fit
+// `size` bytes, or move it to a larger block of its arena,
+// returns BNULL when it has to move through balloc
+static void *resize_block(struct superblock *sb, struct block *block,
+			  size_t order, size_t size)
+{
+	struct arena *arena = sb->arena;
+	size_t new_order, old_size = SIZE(order), dirty;
+	byte_t *new_ptr;
+	int held;
+
+	held = heap_acquire(arena);
+
+	if (SIZE(order) >= size) {
+		while (SIZE(order) / 2 >= size && order > MINORDER) {
+			order--;
+			push_free(arena, OFFSET(block, SIZE(order)),
+				  order, SIZE(order), 0);
+		}
+		tree_set(sb, block, order, order, TREE_USED);
+		heap_release(arena, held);
+		return block;
+	}
+
+	// try to grow current block by joining
+	// with only right buddies
+	new_order = order;
+	while (new_order < sb->order &&
+	       BYTEDIFF(sb->base, block) % SIZE(new_order + 1) == 0 &&
+	       SIZE(new_order) < size &&
+	       sb->tree[NODE(sb, OFFSET(block, SIZE(new_order)),
+			     new_order)] == 0) {
+		new_order++;
+	}
+
+	if (SIZE(new_order) >= size) {
+		// take the buddies out of their free lists
+		for (size_t i = order; i < new_order; i++) {
+			remove_free(arena, OFFSET(block, SIZE(i)), i);
+		}
+		tree_set(sb, block, order, new_order, TREE_USED);
+		heap_release(arena, held);
+		return block;
+	}
+
+	// a larger block comes from the arena that is already
+	// locked, rather than locking one again in balloc
+	new_order = order_of(size);
+	if (new_order > CACHEMAXORDER && size < BUDDY_MMAP_THRESHOLD) {
+		new_ptr = (byte_t *) alloc_block(arena, new_order, &dirty);
+		heap_release(arena, held);
+		if (new_ptr == BNULL) {
+			return BNULL;
+		}
+		copy(new_ptr, block, old_size);
+		free_order(block, order);
+		return new_ptr;
+	}
+	heap_release(arena, held);
+	return BNULL;
+}
+
+#else
+
+// blocks of the lock-free heap are not resized in place,
+// a block stays while it keeps its order
+static void *resize_block(struct superblock *sb, struct block *block,
+			  size_t order, size_t size)
+{
+	(void) sb;
+	return order_of(size) == order ? block : BNULL;
+}
+
+#endif
+
+void *brealloc(void *ptr, size_t size)
+{
+	struct block *block;
+	struct superblock *sb;
+	size_t order, old_size;
+	byte_t *new_ptr;
+
+	if (ptr == BNULL) {
+		return balloc(size);
+	}
+
+	if (size == 0) {
+		bfree(ptr);
+		return BNULL;
+	}
+
+	block = ptr;
+	sb = superblock_of(block);
+
+	// huge allocations that stay huge are resized by
+	// moving pages, not bytes
+	if (sb->huge > 0) {
+		old_size = sb->huge;
+#ifdef MREMAP_MAYMOVE
+		if (size >= BUDDY_MMAP_THRESHOLD) {
+			return huge_realloc(sb, size);
+		}
+#else
+		if (old_size >= size && size >= BUDDY_MMAP_THRESHOLD) {
+			return ptr;
+		}
+#endif
+		goto move;
+	}
+
+	order = order_at(sb, block);
+
+	// slab objects can't be resized in place, they stay
+	// put while the size keeps their class so bfree_sized
+	// finds the class from the size
+	if (is_slab(sb, block, order)) {
+		old_size = class_sizes[SLAB(ptr)->size_class];
+		if (size <= SLABMAX &&
+		    class_of(size) == SLAB(ptr)->size_class) {
+			return ptr;
+		}
+		goto move;
+	}
+	old_size = SIZE(order);
+	// small sizes belong in slabs
+	if (size <= SLABMAX) {
+		goto move;
+	}
+
+	new_ptr = resize_block(sb, block, order, size);
+	if (new_ptr != BNULL) {
+		return new_ptr;
+	}
+
+move:
+	// the old block stays allocated until its contents
+	// are copied, a free block holds free list links
+	new_ptr = balloc(size);
+	if (new_ptr == BNULL) {
+		return BNULL;
+	}
+	copy(new_ptr, ptr, old_size < size ? old_size : size);
+
+	bfree(ptr);
+	return new_ptr;
+}
+
+void *baligned_alloc(size_t alignment, size_t size)
+{
+	size_t order, dirty;
+
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		return BNULL;
+	}
+	if (alignment <= _Alignof(max_align_t) ||
+	    (alignment <= SLABMAX && size <= SLABMAX)) {
+		// slab classes that are multiples of the
+		// alignment are aligned to it
+		return balloc((size + alignment - 1) & ~(alignment - 1));
+	}
+
+	if (!__atomic_load_n(&Buddy_Is_Init, __ATOMIC_ACQUIRE)) {
+		init();
+	}
+	if (size == 0 || size > SIZE_MAX / 2) {
+		return BNULL;
+	}
+
+	// buddy blocks are aligned to their size, so the
+	// block only has to be at least as large as the
+	// alignment
+	order = order_of(size);
+	if (order < (size_t) __builtin_ctzl(alignment)) {
+		order = __builtin_ctzl(alignment);
+	}
+	if (SIZE(order) >= BUDDY_MMAP_THRESHOLD) {
+		return huge_alloc(size, alignment);
+	}
+	return alloc_order(order, &dirty);
+}
+
+void *bcalloc(size_t nitems, size_t size)
+{
+	size_t dirty;
+
+	if (__builtin_mul_overflow(nitems, size, &size)) {
+		return BNULL;
+	}
+	char *ptr = allocate(size, &dirty);
+	if (ptr == BNULL) {
+		return BNULL;
+	}
+	// memory fresh from the kernel or purged is
+	// already zero
+	zero(ptr, dirty < size ? dirty : size);
+	return ptr;
+}
+
+int btrim(size_t pad)
+{
+	size_t purged = 0;
+
+	if (!__atomic_load_n(&Buddy_Is_Init, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+#ifndef BUDDY_LOCKFREE
+	for (size_t i = 0; i < NARENAS; i++) {
+		int held = heap_acquire(&arenas[i]);
+
+		purged += purge(&arenas[i], 0, pad, SIZE_MAX);
+		heap_release(&arenas[i], held);
+	}
+#else
+	// the lock-free heap keeps its memory
+	(void) pad;
+#endif
+	return purged > 0;
+}
+
+size_t busable_size(void *ptr)
+{
+	struct superblock *sb;
+	size_t order;
+
+	if (ptr == BNULL) {
+		return 0;
+	}
+
+	sb = superblock_of(ptr);
+	if (sb->huge > 0) {
+		return sb->huge;
+	}
+	order = order_at(sb, ptr);
+	if (is_slab(sb, ptr, order)) {
+		return class_sizes[SLAB(ptr)->size_class];
+	}
+	return SIZE(order);
+}
+
+#ifdef BUDDY_STDLIB_OVERRIDE
+// the rest of the aligned allocation family, so none
+// of it falls through to the libc allocator
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (alignment == 0 || alignment % sizeof(void *) != 0 ||
+	    (alignment & (alignment - 1)) != 0) {
+		return EINVAL;
+	}
+	ptr = baligned_alloc(alignment, size);
+	if (ptr == BNULL && size > 0) {
+		return ENOMEM;
+	}
+	*memptr = ptr;
+	return 0;
+}
+
+// like glibc, alignments that aren't powers of two
+// are rounded up to one rather than rejected
+void *memalign(size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (alignment > SIZE_MAX / 2 + 1) {
+		errno = EINVAL;
+		return BNULL;
+	}
+	ptr = baligned_alloc(SIZE(order_of(alignment)), size);
+	if (ptr == BNULL && size > 0) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+void *valloc(size_t size)
+{
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+// like glibc, 0 bytes get a page
+void *pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (size > SIZE_MAX - page) {
+		errno = ENOMEM;
+		return BNULL;
+	}
+	if (size == 0) {
+		size = page;
+	}
+	return memalign(page, (size + page - 1) & ~(page - 1));
 }
 
-#ifdef BUDDY_STDLIB_OVERRIDE
 #pragma GCC diagnostic pop
 #endif
 